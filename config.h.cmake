@@ -1,2 +1,7 @@
 #cmakedefine HAVE_FALLOCATE
+#cmakedefine HAVE_COPY_FILE_RANGE
+#cmakedefine HAVE_LIBURING
+#cmakedefine HAVE_IO_URING_PREP_FGETXATTR
+#cmakedefine HAVE_XFS_H
+#cmakedefine HAVE_SYS_FANOTIFY_H
 #define VERSION "@VERSION@"
\ No newline at end of file
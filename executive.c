@@ -18,9 +18,12 @@
 /***************************************************************************/
 
 #define _GNU_SOURCE
+#include "config.h"
 #include "executive.h"
-#include "linux.h"              // is_lock_canceled()
+#include "linux.h"              // is_lock_canceled(), clone_file()
+#include "order.h"              // sort_list()
 #include "signals.h"
+#include "throttle.h"           // throttle(), throttle_hold()
 #include <alloca.h>
 #include <stdlib.h>
 #include <stdio.h>              // asprintf()
@@ -28,6 +31,7 @@
 #include <assert.h>
 #include <string.h>
 #include <linux/fs.h>           // FIGETBSZ
+#include <linux/magic.h>        // EXT4_SUPER_MAGIC, XFS_SUPER_MAGIC...
 #include <limits.h>             // SSIZE_MAX
 #include <sys/stat.h>           // stat()
 #include <unistd.h>             // stat()
@@ -36,149 +40,1044 @@
 #include <sys/types.h>          // opendir()
 #include <dirent.h>             // opendir()
 #include <sys/time.h>           // futimes()
+#include <stdint.h>             // uintptr_t
+#include <fcntl.h>              // splice()
+#if defined (__x86_64__) || defined (__i386__)
+# include <immintrin.h>         // SSE2 and AVX2 intrinsics
+#endif
+#ifdef HAVE_LIBURING
+# include <liburing.h>          // io_uring_*()
+#endif
 
-int
-fcopy (int in_fd, int out_fd, size_t gap, bool stop_if_input_unlocked)
+/* The ways copy_chunk() can move datas, from the fastest to the
+ * slowest. It falls back on the next one when the kernel refuses.
+ */
+enum copy_engine
 {
-  assert (in_fd > -1), assert (out_fd > -1);
-  size_t buffsize = 65535;      // Must fit in a integer
-  int *buffer;
-  /* Prepare files */
-  if (-1 == lseek (in_fd, (off_t) 0, SEEK_SET)
-      || -1 == lseek (out_fd, (off_t) 0, SEEK_SET)
-      || -1 == ftruncate (out_fd, (off_t) 0))
-    return -1;
-  /* Optimisation (on Linux it double the readahead window) */
-  posix_fadvise (in_fd, (off_t) 0, (off_t) 0, POSIX_FADV_SEQUENTIAL);
-  posix_fadvise (in_fd, (off_t) 0, (off_t) 0, POSIX_FADV_NOREUSE);
-  /* Get a buffer... */
-  {
-    if (gap)
+  COPY_FILE_RANGE,              // in-kernel copy, may share extents
+  COPY_SPLICE,                  // page moves through a pipe
+  COPY_BUFFER,                  // plain read() and write()
+};
+
+struct copier
+{
+  enum copy_engine engine;
+  int pipe[2];                  // for COPY_SPLICE, -1 if not opened
+};
+
+/* Returns true if errno says that an engine is not supported for
+ * this pair of files, rather than that the copy failed.
+ */
+static bool
+engine_unsupported (void)
+{
+  return ENOSYS == errno || EXDEV == errno || EINVAL == errno
+    || EOPNOTSUPP == errno || EBADF == errno;
+}
+
+/* Copies at most len bytes from in_fd to out_fd, at their current
+ * offsets.
+ * Returns the number of bytes copied, 0 at EOF, -1 if failed.
+ */
+static ssize_t
+copy_chunk (struct copier *c, int in_fd, int out_fd, size_t len)
+{
+  ssize_t res;
+  switch (c->engine)
+    {
+    case COPY_FILE_RANGE:
+#ifdef HAVE_COPY_FILE_RANGE
+      res = copy_file_range (in_fd, NULL, out_fd, NULL, len, 0);
+      if (res >= 0 || !engine_unsupported ())
+        return res;
+#endif
+      c->engine = COPY_SPLICE;
+      /* Fall through */
+    case COPY_SPLICE:
+      if (-1 == c->pipe[0] && -1 == pipe (c->pipe))
+        c->pipe[0] = c->pipe[1] = -1;
+      else
+        {
+          res = splice (in_fd, NULL, c->pipe[1], NULL, len, SPLICE_F_MOVE);
+          if (res >= 0)
+            {
+              /* Empty the pipe, the datas are lost if this fails */
+              for (ssize_t done = 0, out; done < res; done += out)
+                {
+                  out = splice (c->pipe[0], NULL, out_fd, NULL,
+                                (size_t) (res - done), SPLICE_F_MOVE);
+                  if (0 >= out)
+                    return -1;
+                }
+              return res;
+            }
+          if (!engine_unsupported ())
+            return -1;
+        }
+      c->engine = COPY_BUFFER;
+      /* Fall through */
+    case COPY_BUFFER:
+    default:
       {
-        int physbsize;
-        /*  Convert the gap in a number of blocks
-         *  The idea is that it would be useless to make only a part of a block
-         * sparse, so we use buffers of physical block size and make a hole
-         * only if there's enough consecutive empty buffers.
-         */
-        if (-1 == ioctl (out_fd, FIGETBSZ, &physbsize))
+        char buffer[65536];
+        if (len > sizeof (buffer))
+          len = sizeof (buffer);
+        res = read (in_fd, buffer, len);
+        if (0 < res && res != write (out_fd, buffer, (size_t) res))
           return -1;
-        else if (physbsize < 1)
-          {
-            error (0, 0, "Buggy FS: negative block size !");
-            return -1;
-          }
-        if (gap >= physbsize)
-          {
-            gap /= (size_t) physbsize;
-            // now gap is number of empty buffers required to make the file sparse
-            buffsize = (size_t) physbsize;
-          }
+        return res;
       }
-    if (buffsize > SSIZE_MAX)
+    }
+}
+
+/* Copies len bytes from in_fd to out_fd, at their current offsets,
+ * without going through user space. This is the body of fcopy() when
+ * gap is 0.
+ * Return -1 and set errno if failed, -2 if canceled, else 0.
+ */
+static int
+copy_segment (int in_fd, int out_fd, off_t len, bool stop_if_input_unlocked)
+{
+  const off_t CHUNKSIZE = 8 * 1024 * 1024;
+  struct copier c = {
+    .engine = COPY_FILE_RANGE,
+    .pipe = {-1, -1},
+  };
+  int res = 0;
+  while (len > 0)
+    {
+      ssize_t done;
+      off_t chunk = throttle_chunk (len < CHUNKSIZE ? len : CHUNKSIZE);
+      throttle (chunk);
+      /* Check if we have to cancel the copy */
+      if (stop_if_input_unlocked && !is_locked (in_fd))
+        {
+          // The warning is shown by the signal handler
+          errno = 0;
+          res = -2;
+          break;
+        }
+      done = copy_chunk (&c, in_fd, out_fd, (size_t) chunk);
+      if (-1 == done)
+        res = -1;
+      if (0 >= done)
+        break;                  // if EOF, the size check will complain
+      len -= done;
+    }
+  if (-1 != c.pipe[0])
+    {
+      int errsv = errno;
+      close (c.pipe[0]);
+      close (c.pipe[1]);
+      errno = errsv;
+    }
+  return res;
+}
+
+/*  Zero detection, used by copy_sparse_segment() to find holes.
+ *  Each function returns true if the size first bytes of block are
+ * '\0'. Except for the generic one, size must be a multiple of 128,
+ * that is true of all sane block sizes.
+ */
+static bool
+is_empty_generic (const void *block, size_t size)
+{
+  const unsigned long *words = block;
+  const char *tail = (const char *) block + size - size % sizeof (*words);
+  for (size_t i = 0; i < size / sizeof (*words); i++)
+    if (words[i])
+      return false;
+  for (size_t i = 0; i < size % sizeof (*words); i++)
+    if (tail[i])
+      return false;
+  return true;
+}
+
+/* Used to copy without making holes
+ */
+static bool
+is_empty_never (const void *block, size_t size)
+{
+  assert (block), assert (size);
+  return false;
+}
+
+#if defined (__x86_64__) || defined (__i386__)
+__attribute__ ((target ("sse2")))
+static bool
+is_empty_sse2 (const void *block, size_t size)
+{
+  const __m128i *vects = block;
+  for (size_t i = 0; i < size / sizeof (*vects); i += 4)
+    {
+      __m128i acc = _mm_or_si128 (_mm_or_si128 (_mm_loadu_si128 (vects + i),
+                                                _mm_loadu_si128 (vects + i + 1)),
+                                  _mm_or_si128 (_mm_loadu_si128 (vects + i + 2),
+                                                _mm_loadu_si128 (vects + i + 3)));
+      if (0xFFFF != _mm_movemask_epi8 (_mm_cmpeq_epi8 (acc,
+                                                       _mm_setzero_si128 ())))
+        return false;
+    }
+  return true;
+}
+
+__attribute__ ((target ("avx2")))
+static bool
+is_empty_avx2 (const void *block, size_t size)
+{
+  const __m256i *vects = block;
+  for (size_t i = 0; i < size / sizeof (*vects); i += 4)
+    {
+      __m256i acc =
+        _mm256_or_si256 (_mm256_or_si256 (_mm256_loadu_si256 (vects + i),
+                                          _mm256_loadu_si256 (vects + i + 1)),
+                         _mm256_or_si256 (_mm256_loadu_si256 (vects + i + 2),
+                                          _mm256_loadu_si256 (vects + i + 3)));
+      if (!_mm256_testz_si256 (acc, acc))
+        return false;
+    }
+  return true;
+}
+#endif
+
+/* Returns the fastest zero detection function this CPU can run
+ */
+static bool (*select_is_empty (void)) (const void *, size_t)
+{
+#if defined (__x86_64__) || defined (__i386__)
+  if (__builtin_cpu_supports ("avx2"))
+    return is_empty_avx2;
+  if (__builtin_cpu_supports ("sse2"))
+    return is_empty_sse2;
+#endif
+  return is_empty_generic;
+}
+
+/* Reads len bytes at offset unless EOF is reached.
+ * Returns the number of bytes read, -1 if failed.
+ */
+static ssize_t
+pread_full (int fd, char *buffer, size_t len, off_t offset)
+{
+  size_t done = 0;
+  while (done < len)
+    {
+      ssize_t rlen = pread (fd, buffer + done, len - done,
+                            offset + (off_t) done);
+      if (-1 == rlen)
+        return -1;
+      if (0 == rlen)
+        break;
+      done += (size_t) rlen;
+    }
+  return (ssize_t) done;
+}
+
+/*  Runs pwrite() if writing, else pread(), on a file opened with
+ * O_DIRECT, which refuses requests that are not aligned on align.
+ * Those are done through the page cache instead.
+ *  A read is extended to a multiple of align, so buffer must be large
+ * enough. Returns what pread() or pwrite() would.
+ */
+static ssize_t
+prw_direct (bool writing, int fd, char *buffer, size_t len, off_t offset,
+            size_t align)
+{
+  if (0 == offset % (off_t) align && 0 == (uintptr_t) buffer % align
+      && (!writing || 0 == len % align))
+    {
+      ssize_t res = writing ? pwrite (fd, buffer, len, offset)
+        : pread (fd, buffer, (len + align - 1) / align * align, offset);
+      return res > (ssize_t) len ? (ssize_t) len : res;
+    }
+  else
+    {
+      int flags = fcntl (fd, F_GETFL);
+      ssize_t res = -1;
+      if (-1 != flags && -1 != fcntl (fd, F_SETFL, flags & ~O_DIRECT))
+        {
+          int errsv;
+          res = writing ? pwrite (fd, buffer, len, offset)
+            : pread_full (fd, buffer, len, offset);
+          errsv = errno;
+          if (-1 == fcntl (fd, F_SETFL, flags))
+            res = -1;
+          else
+            errno = errsv;
+        }
+      return res;
+    }
+}
+
+/* Sets O_DIRECT on both files and saves their previous flags in flags.
+ * Returns false, with the files unchanged, if one of them refuses.
+ */
+static bool
+enter_direct_io (int in_fd, int out_fd, int flags[2])
+{
+  flags[0] = fcntl (in_fd, F_GETFL);
+  flags[1] = fcntl (out_fd, F_GETFL);
+  if (-1 == flags[0] || -1 == flags[1])
+    return false;
+  if (-1 == fcntl (in_fd, F_SETFL, flags[0] | O_DIRECT))
+    return false;
+  if (-1 == fcntl (out_fd, F_SETFL, flags[1] | O_DIRECT))
+    {
+      fcntl (in_fd, F_SETFL, flags[0]);
+      return false;
+    }
+  return true;
+}
+
+/* Restores the flags saved by enter_direct_io()
+ */
+static void
+leave_direct_io (int in_fd, int out_fd, const int flags[2])
+{
+  int errsv = errno;
+  fcntl (in_fd, F_SETFL, flags[0]);
+  fcntl (out_fd, F_SETFL, flags[1]);
+  errno = errsv;
+}
+
+/* The buffers of copy_sparse_segment()
+ */
+struct sparse_buffers
+{
+  char *buffer;                 // datas being copied
+  const char *empty;            // only '\0'
+  size_t buffsize;              // size of both buffers
+  size_t blocksize;             // holes granularity, divides buffsize
+  off_t gap;                    // minimal size of a hole
+  bool direct;                  // files are opened with O_DIRECT
+  bool (*is_empty) (const void *block, size_t size);
+};
+
+/* Where split_chunk() sends the datas it keeps.
+ */
+struct sparse_writer
+{
+  int out_fd;
+  size_t direct;                // O_DIRECT alignment, 0 if not used
+  off_t empty_start;            // Empty blocks not written yet...
+  off_t empty_len;              // ...that can go on in the next chunk
+  /* Writes len bytes from buffer at offset, returns -1 if failed */
+  int (*write) (struct sparse_writer * w, const char *buffer, size_t len,
+                off_t offset);
+};
+
+/* Writes len bytes of '\0' at offset.
+ * Returns -1 if failed, else 0.
+ */
+static int
+write_empty (const struct sparse_buffers *sb, struct sparse_writer *w,
+             off_t offset, off_t len)
+{
+  while (len)
+    {
+      size_t wlen = (size_t) len < sb->buffsize ? (size_t) len : sb->buffsize;
+      if (-1 == w->write (w, sb->empty, wlen, offset))
+        return -1;
+      offset += (off_t) wlen;
+      len -= (off_t) wlen;
+    }
+  return 0;
+}
+
+/*  Splits the len bytes read at offset in buffer in runs of datas and
+ * runs of empty blocks, and writes all but the runs of at least sb->gap
+ * bytes, which become holes.
+ *  An empty run that reaches the end of buffer is kept in w, as it
+ * can go on in the next chunk. A partial block is never a hole.
+ * Returns -1 if failed, else 0.
+ */
+static int
+split_chunk (const struct sparse_buffers *sb, struct sparse_writer *w,
+             const char *buffer, size_t len, off_t offset)
+{
+  size_t data = 0;              // Start of the datas not written yet
+  for (size_t pos = 0; pos < len; pos += sb->blocksize)
+    {
+      size_t run;               // Start of the empty run in buffer
+      if (pos + sb->blocksize <= len
+          && sb->is_empty (buffer + pos, sb->blocksize))
+        {
+          if (!w->empty_len)
+            w->empty_start = offset + (off_t) pos;
+          w->empty_len += (off_t) sb->blocksize;
+          continue;
+        }
+      if (!w->empty_len)
+        continue;
+      /* This block of datas ends an empty run */
+      run = w->empty_start > offset ? (size_t) (w->empty_start - offset) : 0;
+      if (w->empty_len >= sb->gap)
+        {
+          /* Make a hole: write what is before and skip the run */
+          if (run > data
+              && -1 == w->write (w, buffer + data, run - data,
+                                 offset + (off_t) data))
+            return -1;
+          data = pos;
+        }
+      else if (w->empty_start < offset
+               && -1 == write_empty (sb, w, w->empty_start,
+                                     offset - w->empty_start))
+        return -1;              // The run was too short to be a hole
+      w->empty_len = 0;
+    }
+  /* Keep the trailing empty run for the next chunk */
+  if (w->empty_len)
+    len = w->empty_start > offset ? (size_t) (w->empty_start - offset) : 0;
+  if (len > data
+      && -1 == w->write (w, buffer + data, len - data, offset + (off_t) data))
+    return -1;
+  return 0;
+}
+
+/* Writes the empty run kept by split_chunk() at the end of a segment,
+ * unless it is long enough to be a hole.
+ * Returns -1 if failed, else 0.
+ */
+static int
+finish_segment (const struct sparse_buffers *sb, struct sparse_writer *w)
+{
+  int res = 0;
+  if (w->empty_len && w->empty_len < sb->gap)
+    res = write_empty (sb, w, w->empty_start, w->empty_len);
+  w->empty_len = 0;
+  return res;
+}
+
+/* A sparse_writer.write() that just calls pwrite()
+ */
+static int
+pwrite_full (struct sparse_writer *w, const char *buffer, size_t len,
+             off_t offset)
+{
+  if (w->direct)
+    return len == prw_direct (true, w->out_fd, (char *) buffer, len,
+                              offset, w->direct) ? 0 : -1;
+  return len == pwrite (w->out_fd, buffer, len, offset) ? 0 : -1;
+}
+
+/* Returns how many of the len bytes left to copy are read at once, at
+ * most max: what throttle_chunk() lets go, in whole blocks so that the
+ * holes and O_DIRECT stay aligned.
+ */
+static size_t
+sparse_chunk (const struct sparse_buffers *sb, off_t len, size_t max)
+{
+  size_t chunk = (size_t) len < max ? (size_t) len : max;
+  if (chunk <= sb->blocksize)
+    return chunk;
+  chunk = (size_t) throttle_chunk ((llint) chunk);
+  return chunk > sb->blocksize ? chunk - chunk % sb->blocksize
+    : sb->blocksize;
+}
+
+/* Copies len bytes from in_fd to out_fd, starting at offset, through
+ * sb->buffer. Makes a hole when there is more than sb->gap consecutive
+ * bytes of '\0' in empty blocks.
+ * Return -1 and set errno if failed, -2 if canceled, else 0.
+ */
+static int
+copy_sparse_segment (int in_fd, int out_fd, off_t offset, off_t len,
+                     const struct sparse_buffers *sb,
+                     bool stop_if_input_unlocked)
+{
+  struct sparse_writer w = {
+    .out_fd = out_fd,
+    .direct = sb->direct ? sb->blocksize : 0,
+    .write = pwrite_full,
+  };
+  while (len > 0)
+    {
+      ssize_t rlen;
+      size_t chunk = sparse_chunk (sb, len, sb->buffsize);
+      throttle ((llint) chunk);
+      /* Check if we have to cancel the copy */
+      if (stop_if_input_unlocked && !is_locked (in_fd))
+        {
+          // The warning is shown by the signal handler
+          errno = 0;
+          return -2;
+        }
+      /* Read */
+      if (sb->direct)
+        rlen = prw_direct (false, in_fd, sb->buffer, chunk, offset,
+                           sb->blocksize);
+      else
+        rlen = pread_full (in_fd, sb->buffer, chunk, offset);
+      if (-1 == rlen)
+        return -1;
+      if (0 == rlen)
+        break;                  // if EOF, the size check will complain
+      if (-1 == split_chunk (sb, &w, sb->buffer, (size_t) rlen, offset))
+        return -1;
+      offset += rlen;
+      len -= rlen;
+    }
+  return finish_segment (sb, &w);
+}
+
+#ifdef HAVE_LIBURING
+/*  An io_uring version of copy_sparse_segment(). It keeps URING_DEPTH
+ * reads in flight, and the writes of the chunks already read.
+ *  Chunk n is read in slot n % URING_DEPTH and processed in order, so
+ * split_chunk() sees them as copy_sparse_segment() does. A slot is
+ * read again once all the writes from its buffer completed.
+ */
+
+#define URING_DEPTH 8                   // Buffers, so reads in flight
+#define URING_BUFFSIZE (1024 * 1024)    // Size of each buffer
+#define URING_ENTRIES 64                // Size of the submission queue
+
+/* The state of the engine, set up by uring_setup() on first use
+ */
+static struct
+{
+  bool ready;                   // true if the ring can be used
+  bool tried;                   // true if uring_setup() has been called
+  bool fixed;                   // true if buffers are registered
+  struct io_uring ring;
+  char *buffers;                // URING_DEPTH * URING_BUFFSIZE
+  uint inflight;                // Number of requests not completed
+} URING;
+
+/* A chunk of the segment being copied
+ */
+struct uring_slot
+{
+  int fd;                       // where the chunk is read
+  off_t offset;                 // where the chunk was read
+  size_t want;                  // size asked
+  size_t done;                  // size read so far
+  ssize_t len;                  // size read, -1 if not read yet
+  bool busy;                    // a read is in flight or to be split
+  uint writes;                  // writes in flight from the buffer
+};
+
+/* The sparse_writer of copy_sparse_segment_uring()
+ */
+struct uring_writer
+{
+  struct sparse_writer w;
+  struct uring_slot *slots;
+  int error;                    // errno of the first failed request
+};
+
+/* Bits of the sqe->user_data, the rest is the size of the request */
+#define URING_WRITE 1           // the request is a write
+#define URING_SLOT_SHIFT 1      // then the slot, URING_DEPTH if none
+#define URING_LEN_SHIFT 8
+
+/* Prepares the io_uring engine. Returns false if it can't be used.
+ */
+static bool
+uring_setup (void)
+{
+  if (URING.tried)
+    return URING.ready;
+  URING.tried = true;
+  if (0 > io_uring_queue_init (URING_ENTRIES, &URING.ring, 0))
+    return false;
+  if (0 != posix_memalign ((void **) &URING.buffers, 4096,
+                           URING_DEPTH * URING_BUFFSIZE))
+    {
+      io_uring_queue_exit (&URING.ring);
+      return false;
+    }
+  /* Registered buffers are not remapped by each request, but this
+   * may fail because of RLIMIT_MEMLOCK.
+   */
+  {
+    struct iovec iov[URING_DEPTH];
+    for (int i = 0; i < URING_DEPTH; i++)
       {
-        buffsize = SSIZE_MAX;
-        gap = 0;
+        iov[i].iov_base = URING.buffers + i * URING_BUFFSIZE;
+        iov[i].iov_len = URING_BUFFSIZE;
       }
-    buffer = alloca (buffsize); // better than "goto freeall"... or not ?
-    // Else would read uninitialised datas when filesize < buffsize
-    // and is_empty could be set uncorrectly.
-    memset (buffer, 0xFF, buffsize);
+    URING.fixed = 0 == io_uring_register_buffers (&URING.ring, iov,
+                                                  URING_DEPTH);
   }
-  /* Let's go ! */
+  URING.ready = true;
+  return true;
+}
+
+static int uring_queue_read (struct uring_writer *uw, uint slot);
+
+/* Waits for a request to complete and records its result in uw.
+ * A short read is queued again for the rest, only a read of 0 byte
+ * means EOF.
+ * Returns -1 if io_uring failed, else 0.
+ */
+static int
+uring_reap (struct uring_writer *uw)
+{
+  bool again = false;           // a short read has to go on
+  struct io_uring_cqe *cqe;
+  int res = io_uring_wait_cqe (&URING.ring, &cqe);
+  if (0 > res)
+    {
+      errno = -res;
+      return -1;
+    }
   {
-    int len = 0;
-    uint empty_buffs = 0;       // Number of consecutive empty buffers, for sparse files
-    bool is_empty = 0;          // Tell if the buffer is empty, for sparse files
-    int *empty = NULL;          // An empty buffer, for sparse files
-    if (gap)
+    __u64 data = cqe->user_data;
+    uint slot = (uint) (data >> URING_SLOT_SHIFT) & 0x7F;
+    size_t len = (size_t) (data >> URING_LEN_SHIFT);
+    if (data & URING_WRITE)
       {
-        empty = alloca (buffsize);      // better than goto free()... or not ?
-        if (!empty)
-          return -1;
-        memset (empty, '\0', buffsize);
+        if (slot < URING_DEPTH)
+          uw->slots[slot].writes--;
+        if (!uw->error && cqe->res != len)
+          uw->error = 0 > cqe->res ? -cqe->res : EIO;
       }
-    while (true)
+    else if (0 > cqe->res)
       {
-        bool eof;               // tell if we are at end of file
-        bool cant_wait;         // tell if we need to flush buffers
-        /* Check if we have to cancel the copy */
-        if (stop_if_input_unlocked && !is_locked (in_fd))
-          {
-            // The warning is shown by the signal handler
-            errno = 0;
-            return -2;
-          }
-        /* Read */
-        len = (int) read (in_fd, buffer, buffsize);
-        if (-1 == len)
-          return -1;
-        eof = (len != buffsize);
-        if (gap)
-          {
-            assert (0 == buffsize % sizeof (*buffer));
-            /* Is the buffer empty ? */
-            is_empty = 1;
-            // at EOF we will take in account previously read datas
-            // but that is not important
-            for (uint i = 0; i < buffsize / sizeof (*buffer); i++)
-              if (buffer[i])
-                {
-                  is_empty = 0; // no
-                  break;
-                }
-            if (eof)
-              is_empty = 0;     // force write of the last buffer
-            if (is_empty)
-              empty_buffs++;    // (can't overflow, see cant_wait two lines down)
-          }
-        /* if in sparse mode, we'll wait for eof or data, or int overflow before writing */
-        cant_wait = !is_empty || eof
-          || (empty_buffs + 1) * buffsize > INT_MAX;
-        if (gap && cant_wait)
-          {
-            /* Should we make a hole ? */
-            if (empty_buffs >= gap && len != 0) // Don't finish with a hole if len == 0
-              {
-                if (-1 ==
-                    lseek (out_fd, (off_t) (empty_buffs * buffsize),
-                           SEEK_CUR))
-                  return -1;
-                empty_buffs = 0;
-              }
-            else
-              {
-                // Write empty space
-                for (; empty_buffs; empty_buffs--)
-                  if (buffsize != write (out_fd, empty, buffsize))
-                    return -1;
-                assert (0 == empty_buffs);
-              }
-          }
-        if (!gap || cant_wait)
-          {
-            if (len != write (out_fd, buffer, (uint) len))
-              return -1;
-          }
-        if (eof)
-          break;
+        uw->slots[slot].len = (ssize_t) uw->slots[slot].done;
+        if (!uw->error)
+          uw->error = -cqe->res;
+      }
+    else
+      {
+        struct uring_slot *s = uw->slots + slot;
+        s->done += (size_t) cqe->res;
+        again = 0 != cqe->res && s->done < s->want;
+        if (!again)
+          s->len = (ssize_t) s->done;
       }
+    io_uring_cqe_seen (&URING.ring, cqe);
+    URING.inflight--;
+    if (again && (-1 == uring_queue_read (uw, slot)
+                  || 0 > (res = io_uring_submit (&URING.ring))))
+      {
+        if (0 > res)
+          errno = -res;
+        uw->slots[slot].len = (ssize_t) uw->slots[slot].done;
+        if (!uw->error)
+          uw->error = errno ? errno : EIO;
+      }
+  }
+  return 0;
+}
+
+/* Returns a submission entry, submitting or waiting for the pending
+ * ones if there is no room left. Returns NULL if io_uring failed.
+ */
+static struct io_uring_sqe *
+uring_get_sqe (struct uring_writer *uw)
+{
+  struct io_uring_sqe *sqe;
+  while (URING.inflight >= URING_ENTRIES)
+    if (-1 == uring_reap (uw))
+      return NULL;
+  sqe = io_uring_get_sqe (&URING.ring);
+  if (!sqe)
+    {
+      int res = io_uring_submit (&URING.ring);
+      if (0 > res)
+        {
+          errno = -res;
+          return NULL;
+        }
+      sqe = io_uring_get_sqe (&URING.ring);
+    }
+  if (sqe)
+    URING.inflight++;
+  return sqe;
+}
+
+/* A sparse_writer.write() that queues the write
+ */
+static int
+uring_write (struct sparse_writer *w, const char *buffer, size_t len,
+             off_t offset)
+{
+  struct uring_writer *uw = (struct uring_writer *) w;
+  struct io_uring_sqe *sqe = uring_get_sqe (uw);
+  uint slot = URING_DEPTH;
+  if (!sqe)
+    return -1;
+  if (buffer >= URING.buffers
+      && buffer < URING.buffers + URING_DEPTH * URING_BUFFSIZE)
+    slot = (uint) ((buffer - URING.buffers) / URING_BUFFSIZE);
+  if (URING.fixed && slot < URING_DEPTH)
+    io_uring_prep_write_fixed (sqe, w->out_fd, buffer, (unsigned) len,
+                               (__u64) offset, (int) slot);
+  else
+    io_uring_prep_write (sqe, w->out_fd, buffer, (unsigned) len,
+                         (__u64) offset);
+  sqe->user_data = ((__u64) len << URING_LEN_SHIFT)
+    | ((__u64) slot << URING_SLOT_SHIFT) | URING_WRITE;
+  if (slot < URING_DEPTH)
+    uw->slots[slot].writes++;
+  return 0;
+}
+
+/* Queues the read of what slot still wants.
+ * Returns -1 if failed, else 0.
+ */
+static int
+uring_queue_read (struct uring_writer *uw, uint slot)
+{
+  struct uring_slot *s = uw->slots + slot;
+  struct io_uring_sqe *sqe = uring_get_sqe (uw);
+  char *buffer = URING.buffers + slot * URING_BUFFSIZE + s->done;
+  unsigned len = (unsigned) (s->want - s->done);
+  __u64 offset = (__u64) s->offset + s->done;
+  if (!sqe)
+    return -1;
+  if (URING.fixed)
+    io_uring_prep_read_fixed (sqe, s->fd, buffer, len, offset, (int) slot);
+  else
+    io_uring_prep_read (sqe, s->fd, buffer, len, offset);
+  sqe->user_data = ((__u64) len << URING_LEN_SHIFT)
+    | ((__u64) slot << URING_SLOT_SHIFT);
+  return 0;
+}
+
+/* Queues the read of len bytes at offset in slot.
+ * Returns -1 if failed, else 0.
+ */
+static int
+uring_read (struct uring_writer *uw, int in_fd, uint slot, size_t len,
+            off_t offset)
+{
+  struct uring_slot *s = uw->slots + slot;
+  s->fd = in_fd;
+  s->offset = offset;
+  s->want = len;
+  s->done = 0;
+  s->len = -1;
+  if (-1 == uring_queue_read (uw, slot))
+    return -1;
+  s->busy = true;
+  return 0;
+}
+
+/* Same as copy_sparse_segment(), but with io_uring.
+ */
+static int
+copy_sparse_segment_uring (int in_fd, int out_fd, off_t offset, off_t len,
+                           const struct sparse_buffers *sb,
+                           bool stop_if_input_unlocked)
+{
+  struct uring_slot slots[URING_DEPTH];
+  struct uring_writer uw = {
+    .w = {
+          .out_fd = out_fd,
+          .write = uring_write,
+          },
+    .slots = slots,
+    .error = 0,
+  };
+  const off_t end = offset + len;
+  uint head = 0;                // The next slot to split
+  uint tail = 0;                // The next slot to read
+  int res = 0;
+  bool eof = false;             // the file ended before the segment
+  memset (slots, 0, sizeof (slots));
+  while (true)
+    {
+      /* Read the next chunks in the free slots */
+      while (0 == res && !uw.error && offset < end
+             && !slots[tail].busy && !slots[tail].writes)
+        {
+          size_t rlen = sparse_chunk (sb, end - offset, URING_BUFFSIZE);
+          throttle ((llint) rlen);
+          /* Check if we have to cancel the copy */
+          if (stop_if_input_unlocked && !is_locked (in_fd))
+            {
+              // The warning is shown by the signal handler
+              res = -2;
+              break;
+            }
+          if (-1 == uring_read (&uw, in_fd, tail, rlen, offset))
+            {
+              res = -1;
+              break;
+            }
+          offset += (off_t) rlen;
+          tail = (tail + 1) % URING_DEPTH;
+        }
+      if (URING.inflight)
+        {
+          int sres = io_uring_submit (&URING.ring);
+          if (0 > sres && 0 == res)
+            {
+              errno = -sres;
+              res = -1;
+            }
+        }
+      /* Is there anything left to do ? */
+      if (!slots[head].busy || 0 != res || uw.error)
+        {
+          if (!URING.inflight)
+            break;
+          if (-1 == uring_reap (&uw))
+            return -1;          // Can't wait for the buffers, fatal
+          continue;
+        }
+      /* Wait for the oldest read, then split it */
+      while (-1 == slots[head].len)
+        if (-1 == uring_reap (&uw))
+          return -1;            // Can't wait for the buffers, fatal
+      if (uw.error)
+        continue;
+      /*  The file shrank, what was read after would be written over a
+       * range that the ftruncate() of fcopy() leaves zero-filled
+       */
+      if ((size_t) slots[head].len < slots[head].want)
+        {
+          eof = true;
+          res = -1;
+        }
+      else if (-1 == split_chunk (sb, &uw.w,
+                                  URING.buffers + head * URING_BUFFSIZE,
+                                  (size_t) slots[head].len,
+                                  slots[head].offset))
+        res = -1;
+      slots[head].busy = false;
+      head = (head + 1) % URING_DEPTH;
+    }
+  if (0 == res && !uw.error)
+    {
+      /* Write the last empty run, if needed, and wait for it */
+      res = finish_segment (sb, &uw.w);
+      if (URING.inflight && 0 > io_uring_submit (&URING.ring))
+        res = -1;
+      while (URING.inflight)
+        if (-1 == uring_reap (&uw))
+          return -1;
+    }
+  if (uw.error)
+    {
+      errno = uw.error;
+      return -1;
+    }
+  if (-2 == res || eof)
+    errno = 0;
+  return res;
+}
+#endif
+
+int
+fcopy (int in_fd, int out_fd, size_t gap, bool stop_if_input_unlocked,
+       bool direct)
+{
+  assert (in_fd > -1), assert (out_fd > -1);
+  /* Size of the buffers used when looking for holes */
+  const size_t BUFFSIZE = 4 * 1024 * 1024;
+  struct sparse_buffers sb = {
+    .buffer = NULL,
+    .empty = NULL,
+  };
+  int flags[2];                 // flags of the files, if direct
+  off_t size;
+  int res = -1;
+  /* Prepare files */
+  {
+    struct stat in_stats;
+    struct stat out_stats;
+    //  An empty out_fd is not truncated, so that its blocks preallocated
+    // with FALLOC_FL_KEEP_SIZE are kept
+    if (-1 == lseek (in_fd, (off_t) 0, SEEK_SET)
+        || -1 == lseek (out_fd, (off_t) 0, SEEK_SET)
+        || -1 == fstat (out_fd, &out_stats)
+        || (out_stats.st_size && -1 == ftruncate (out_fd, (off_t) 0))
+        || -1 == fstat (in_fd, &in_stats))
+      return -1;
+    size = in_stats.st_size;
   }
+  /* Optimisation (on Linux it double the readahead window) */
+  posix_fadvise (in_fd, (off_t) 0, (off_t) 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise (in_fd, (off_t) 0, (off_t) 0, POSIX_FADV_NOREUSE);
+  /* Get buffers... */
+  if (gap || direct)
+    {
+      int physbsize;
+      int in_physbsize;
+      /*  The idea is that it would be useless to make only a part of a
+       * block sparse, so we look for empty blocks of physical block size
+       * and make a hole only if there's enough consecutive ones.
+       *  The buffers are much larger than a block, so that reads and
+       * writes are few.
+       */
+      if (-1 == ioctl (out_fd, FIGETBSZ, &physbsize))
+        return -1;
+      else if (physbsize < 1)
+        {
+          error (0, 0, "Buggy FS: negative block size !");
+          return -1;
+        }
+      /*  With O_DIRECT, buffers, offsets and sizes are aligned on the
+       * block size of both files. If they are not powers of 2, or if one
+       * of the FS refuses O_DIRECT, we go through the page cache.
+       */
+      if (direct)
+        direct = -1 != ioctl (in_fd, FIGETBSZ, &in_physbsize)
+          && 0 < in_physbsize && 0 == (in_physbsize & (in_physbsize - 1))
+          && 0 == (physbsize & (physbsize - 1))
+          && enter_direct_io (in_fd, out_fd, flags);
+      if (direct && in_physbsize > physbsize)
+        physbsize = in_physbsize;
+      sb.direct = direct;
+      sb.blocksize = (size_t) physbsize;
+      sb.buffsize = BUFFSIZE - BUFFSIZE % sb.blocksize;
+      if (!sb.buffsize)
+        sb.buffsize = sb.blocksize;
+      sb.gap = (off_t) (gap < sb.blocksize ? sb.blocksize : gap);
+      if (!gap)
+        sb.is_empty = is_empty_never;
+      else
+        sb.is_empty = sb.blocksize % 128 ? is_empty_generic
+          : select_is_empty ();
+      if (0 != posix_memalign ((void **) &sb.buffer,
+                               direct ? sb.blocksize : 64, sb.buffsize)
+          || 0 != posix_memalign ((void **) &sb.empty,
+                                  direct ? sb.blocksize : 64, sb.buffsize))
+        goto freeall;
+      memset ((void *) sb.empty, '\0', sb.buffsize);
+    }
+  /* Let's go !
+   *  We only copy the datas segments of in_fd. Its holes are kept by
+   * seeking over them, so they don't even have to be read.
+   */
+  for (off_t data = 0, hole; data < size; data = hole)
+    {
+      data = lseek (in_fd, data, SEEK_DATA);
+      if (-1 == data && ENXIO == errno)
+        break;                  // Only a hole left
+      else if (-1 == data && EINVAL == errno)
+        data = 0, hole = size;  // Old kernel, the whole file is data
+      else if (-1 == data || -1 == (hole = lseek (in_fd, data, SEEK_HOLE)))
+        goto freeall;
+      if (-1 == lseek (in_fd, data, SEEK_SET)
+          || -1 == lseek (out_fd, data, SEEK_SET))
+        goto freeall;
+#ifdef HAVE_LIBURING
+      /* A single read and write gain nothing from being queued */
+      if (gap && !direct && hole - data > URING_BUFFSIZE && uring_setup ())
+        res = copy_sparse_segment_uring (in_fd, out_fd, data, hole - data,
+                                         &sb, stop_if_input_unlocked);
+      else
+#endif
+      if (gap || direct)
+        res = copy_sparse_segment (in_fd, out_fd, data, hole - data, &sb,
+                                   stop_if_input_unlocked);
+      else
+        res = copy_segment (in_fd, out_fd, hole - data,
+                            stop_if_input_unlocked);
+      if (0 > res)
+        goto freeall;
+    }
+  res = -1;
+  /* Recreates the trailing hole, if any */
+  if (-1 == ftruncate (out_fd, size))
+    goto freeall;
   /* Verify we didn't miss anything */
   {
     struct stat in_stats;
     struct stat out_stats;
     if (fstat (in_fd, &in_stats))
-      return -1;
+      goto freeall;
     if (fstat (out_fd, &out_stats))
-      return -1;
+      goto freeall;
     if (out_stats.st_size != in_stats.st_size)
       {
         errno = 0;              // the error would be in the check and so meaningless
-        return -1;
+        goto freeall;
       }
   }
-  return 1;
+  res = 1;
+freeall:
+  if (direct)
+    leave_direct_io (in_fd, out_fd, flags);
+  {
+    int errsv = errno;
+    free (sb.buffer);
+    free ((void *) sb.empty);
+    errno = errsv;
+  }
+  return res;
+}
+
+/*  Allocates the blocks of fd where like_fd has datas, with fallocate()
+ * mode, in one go so that the filesystem can make them contiguous.
+ * Like in fcopy(), holes are kept by skipping them.
+ *  Returns -1 and sets errno if failed.
+ */
+static int
+allocate_like (int fd, int like_fd, int mode)
+{
+  struct stat st;
+  off_t size;
+  if (-1 == fstat (like_fd, &st))
+    return -1;
+  size = st.st_size;
+  for (off_t data = 0, hole; data < size; data = hole)
+    {
+      data = lseek (like_fd, data, SEEK_DATA);
+      if (-1 == data && ENXIO == errno)
+        break;                  // Only a hole left
+      else if (-1 == data && EINVAL == errno)
+        data = 0, hole = size;  // Old kernel, the whole file is data
+      else if (-1 == data || -1 == (hole = lseek (like_fd, data, SEEK_HOLE)))
+        return -1;
+      if (-1 == fallocate (fd, mode, data, hole - data))
+        return -1;
+    }
+  return 0;
+}
+
+/* Writes "dir/leaf", or just "leaf" if dir is NULL, in a->name,
+ * reusing its buffer. leaf must not point into it.
+ */
+static void
+set_name (struct accused *a, const char *dir, const char *leaf)
+{
+  size_t dirl = dir ? strlen (dir) + 1 : 0;
+  size_t len = dirl + strlen (leaf) + 1;
+  if (len > a->namesize)
+    {
+      char *name = realloc (a->name, len);
+      if (!name)
+        error (1, errno, "%s: malloc() failed", leaf);
+      a->name = name;
+      a->namesize = len;
+    }
+  if (dir)
+    {
+      memcpy (a->name, dir, dirl - 1);
+      a->name[dirl - 1] = '/';
+    }
+  memcpy (a->name + dirl, leaf, len - dirl);
+}
+
+const char *
+accused_name (struct accused *a)
+{
+  assert (a && a->leaf);
+  if (!a->dir)
+    return a->leaf;
+  if (!a->name || '\0' == *a->name)
+    set_name (a, a->dir, a->leaf);
+  return a->name;
+}
+
+void
+adopt_name (struct accused *a)
+{
+  assert (a && a->leaf);
+  if (a->dir)
+    a->leaf = accused_name (a) + strlen (a->dir) + 1;
+  else if (a->leaf != a->name)
+    {
+      set_name (a, NULL, a->leaf);
+      a->leaf = a->name;
+    }
 }
 
 /* Marks a file as shaked
@@ -195,14 +1094,16 @@ capture (struct accused *a, struct law *l)
  * else returns 0.
  */
 static int
-has_been_unlocked (struct accused *a, struct law *l)
+has_been_unlocked (struct accused *a)
 {
-  return l->locks && !is_locked (a->fd);
+  return a->locks && !is_locked (a->fd);
 }
 
 
 /* Restores the mtime of a
  * and mark the file as shaked.
+ *  The in place backends hold no lock, so a write may have come
+ * meanwhile: the times are then left as that write set them.
  */
 // The opposite function is "capture"
 static void
@@ -212,15 +1113,18 @@ release (struct accused *a, struct law *l)
   assert (a->fd >= 0);
   /* Restores mtime */
   {
+    struct stat st;
     struct timeval tv[2];
     tv[0].tv_sec = a->atime;
     tv[0].tv_usec = 0;
     tv[1].tv_sec = a->mtime;
     tv[1].tv_usec = 0;
-    futimes (a->fd, tv);
+    if (BACKEND_COPY == a->backend
+        || (0 == fstat (a->fd, &st) && st.st_mtime == a->mtime))
+      futimes (a->fd, tv);
   }
-  if (has_been_unlocked (a, l))
-    error (0, 0, "%s: concurent accesses", a->name);
+  if (has_been_unlocked (a))
+    error (0, 0, "%s: concurent accesses", accused_name (a));
   return;
 }
 
@@ -230,10 +1134,23 @@ release (struct accused *a, struct law *l)
 static int
 shake_reg_backup_phase (struct accused *a, struct law *l)
 {
-  posix_fadvise (a->fd, (off_t) 0, (off_t) 0, POSIX_FADV_WILLNEED);
-  const int res = fcopy (a->fd, l->tmpfd, MAGICLEAP, l->locks);
+  int res;
+  /*  Where the FS can share extents (btrfs, XFS with reflink) the backup
+   * is instant and writes nothing. This is enough because the rewrite
+   * phase allocates new extents for a->fd anyway.
+   */
+  if (0 == clone_file (l->tmpfd, a->fd))
+    res = 0;
+  else
+    {
+      posix_fadvise (a->fd, (off_t) 0, (off_t) 0, POSIX_FADV_WILLNEED);
+      /* The holes of a->fd are kept by fcopy(), the ones made of '\0'
+       * will be made by the rewrite phase.
+       */
+      res = fcopy (a->fd, l->tmpfd, 0, a->locks, l->direct_io);
+    }
   posix_fadvise (l->tmpfd, (off_t) 0, (off_t) 0, POSIX_FADV_WILLNEED);
-  if (0 > res || has_been_unlocked (a, l))
+  if (0 > res || has_been_unlocked (a))
     return -1;
   else
     return 0;
@@ -252,11 +1169,11 @@ shake_reg_rewrite_phase (struct accused *a, struct law *l)
   char *msg;
   if (-1 == asprintf (&msg,
                       "%s: unrecoverable internal error ! file has been saved at %s",
-                      a->name, l->tmpname))
+                      accused_name (a), l->tmpname))
     {
       int errsv = errno;
       unlink (l->tmpname);      // could work
-      error (1, errsv, "%s: failed to initialize failure manager", a->name);
+      error (1, errsv, "%s: failed to initialize failure manager", accused_name (a));
     }
   /* Disables most signals (except critical ones, see signals.h) */
   enter_critical_mode (msg);
@@ -267,15 +1184,13 @@ shake_reg_rewrite_phase (struct accused *a, struct law *l)
   if (0 > ftruncate (a->fd, (off_t) 0))
     error (1, errno,
            "%s: failed to ftruncate() ! file have been saved at %s",
-           a->name, l->tmpname);
-  if (0 > fallocate(a->fd, FALLOC_FL_KEEP_SIZE, 0, a->size))
-    error (1, errno,
-           "%s: failed to allocate space! file has been saved at %s",
-           a->name, l->tmpname);
-  /* Do the reverse copying */
-  if (0 > fcopy (l->tmpfd, a->fd, GAP, false))
+           accused_name (a), l->tmpname);
+  /* Do the reverse copying, the scheduler can't pause it */
+  throttle_hold (true);
+  if (0 > fcopy (l->tmpfd, a->fd, GAP, false, l->direct_io))
     error (1, errno, "%s: restore failed ! file have been saved at %s",
-           a->name, l->tmpname);
+           accused_name (a), l->tmpname);
+  throttle_hold (false);
   posix_fadvise (a->fd, (off_t) 0, (off_t) 0, POSIX_FADV_DONTNEED);
   posix_fadvise (l->tmpfd, (off_t) 0, (off_t) 0, POSIX_FADV_DONTNEED);
   /* Restores most signals */
@@ -283,6 +1198,196 @@ shake_reg_rewrite_phase (struct accused *a, struct law *l)
   free (msg);
 }
 
+enum backend
+choose_backend (struct accused *a, struct law *l)
+{
+  assert (a), assert (l);
+  assert (a->fd >= 0);
+  if (BACKEND_AUTO != l->backend)
+    return l->backend;
+  switch (get_fs_type (a->fd))
+    {
+    case EXT4_SUPER_MAGIC:     // also ext2 and ext3, see shake_reg()
+      return BACKEND_MOVE_EXT;
+    case BTRFS_SUPER_MAGIC:
+      return BACKEND_DEFRAG;
+#ifdef HAVE_XFS_H
+    case XFS_SUPER_MAGIC:
+      return BACKEND_SWAPEXT;
+#endif
+    default:
+      return BACKEND_COPY;
+    }
+}
+
+/*  Has ext4 exchange the blocks [start, end[ of fd with the ones of donor,
+ * which must be allocated and have the same size. They must be data
+ * blocks of fd, not holes. Returns -1 and sets errno if failed.
+ */
+static int
+move_segment (int fd, int donor, llint start, llint end, int bsize)
+{
+  const llint CHUNK = 64 * 1024 * 1024 / bsize;  // to stay responsive
+  const uint MAX_BUSY = 16;
+  uint busy = 0;                // consecutive EBUSY without progress
+  while (start < end)
+    {
+      llint moved = 0;
+      llint count = throttle_chunk ((end - start < CHUNK ? end - start : CHUNK)
+                                    * bsize) / bsize;
+      if (!count)
+        count = 1;
+      throttle (count * bsize);
+      if (-1 == move_extents (fd, donor, start, count, &moved))
+        {
+          /*  ext4 gives up on cached pages it can't move (eg. large
+           * folios being read meanwhile), so they are dropped and the
+           * next call resumes where this one stopped.
+           */
+          if (EBUSY != errno || (!moved && ++busy >= MAX_BUSY))
+            return -1;
+          if (moved)
+            busy = 0;
+          posix_fadvise (fd, (off_t) ((start + moved) * bsize), (off_t) 0,
+                         POSIX_FADV_DONTNEED);
+        }
+      else if (0 == moved)
+        {
+          errno = EIO;          // should not happen, but would loop
+          return -1;
+        }
+      start += moved;
+    }
+  return 0;
+}
+
+/*  Rewrites a->fd by moving its blocks to a donor file allocated with
+ * allocate_like(). The old blocks go to the donor, which is freed when
+ * closed.
+ *  Returns -1 and sets errno if failed, -2 if ext4 can't move the
+ * extents of this file; a->fd is then untouched.
+ */
+static int
+shake_reg_move_ext (struct accused *a)
+{
+  struct stat st;
+  int bsize;
+  int donor;
+  int res = -1;
+  /*  Dirty pages can't be moved, delayed allocations have no extent to
+   * move, and cached pages make ext4 return EBUSY.
+   */
+  if (-1 == fdatasync (a->fd)
+      || -1 == fstat (a->fd, &st) || -1 == ioctl (a->fd, FIGETBSZ, &bsize))
+    return -1;
+  posix_fadvise (a->fd, (off_t) 0, (off_t) 0, POSIX_FADV_DONTNEED);
+  if (-1 == (donor = open_donor (a->dirfd, a->leaf)))
+    return -1;
+  if (-1 == ftruncate (donor, st.st_size)
+      || -1 == allocate_like (donor, a->fd, 0))
+    goto freeall;
+  /* Moves the data segments, the holes have nothing to move */
+  for (off_t data = 0, hole; data < st.st_size; data = hole)
+    {
+      data = lseek (a->fd, data, SEEK_DATA);
+      if (-1 == data && ENXIO == errno)
+        break;                  // Only a hole left
+      else if (-1 == data && EINVAL == errno)
+        data = 0, hole = st.st_size;    // Old kernel, the whole file is data
+      else if (-1 == data || -1 == (hole = lseek (a->fd, data, SEEK_HOLE)))
+        goto freeall;
+      if (-1 == move_segment (a->fd, donor, data / bsize,
+                              (hole + bsize - 1) / bsize, bsize))
+        {
+          // ext2/3 files without extents, encrypted files...
+          if (0 == data && (EOPNOTSUPP == errno || ENOTTY == errno))
+            res = -2;
+          goto freeall;
+        }
+    }
+  res = 0;
+freeall:
+  {
+    int errsv = errno;
+    close (donor);
+    errno = errsv;
+  }
+  return res;
+}
+
+/*  Rewrites a->fd the way xfs_fsr does: copies it to a donor file
+ * allocated with allocate_like(), then has XFS swap their extents.
+ * XFS refuses the swap if a->fd has changed since get_xfs_stamp(), so
+ * there is no need for a lock nor for a second copy.
+ *  Returns -1 and sets errno if failed, -2 if XFS can't swap the
+ * extents of this file. a->fd is untouched in both cases.
+ */
+static int
+shake_reg_swapext (struct accused *a, struct law *l)
+{
+  const uint GAP = MAGICLEAP * 4;
+  struct xfs_stamp *stamp;
+  int donor = -1;
+  int res = -1;
+  if (NULL == (stamp = get_xfs_stamp (a->fd)))
+    {
+      // No XFS support at build time, not root...
+      if (EOPNOTSUPP == errno || ENOTTY == errno || EPERM == errno)
+        res = -2;
+      return res;
+    }
+  if (-1 == (donor = open_donor (a->dirfd, a->leaf)))
+    goto freeall;
+  /* fcopy() with a gap never shares extents, unlike copy_file_range() */
+  if (-1 == allocate_like (donor, a->fd, FALLOC_FL_KEEP_SIZE)
+      || 0 > fcopy (a->fd, donor, GAP, false, l->direct_io)
+      || -1 == swap_extents (a->fd, donor, stamp))
+    goto freeall;
+  posix_fadvise (a->fd, (off_t) 0, (off_t) 0, POSIX_FADV_DONTNEED);
+  res = 0;
+freeall:
+  {
+    int errsv = errno;
+    if (-1 != donor)
+      close (donor);
+    free (stamp);
+    errno = errsv;
+  }
+  return res;
+}
+
+/*  Has btrfs rewrite a->fd. Extents shared with snapshots are skipped
+ * by judge_reg(), as btrfs would unshare them.
+ *  The extents smaller than the size of l->maxfragc equal fragments
+ * are rewritten, so that the file would no longer be guilty.
+ *  Returns -1 and sets errno if failed, -2 if btrfs can't defragment
+ * this file.
+ */
+static int
+shake_reg_defrag (struct accused *a, struct law *l)
+{
+  const llint MIN_THRESH = MAGICLEAP * 4;       // btrfs default
+  const llint MAX_THRESH = 128 * 1024 * 1024;   // btrfs max extent size
+  struct stat st;
+  llint thresh;
+  if (-1 == fstat (a->fd, &st))
+    return -1;
+  thresh = st.st_size / (l->maxfragc ? l->maxfragc : 1);
+  if (thresh < MIN_THRESH)
+    thresh = MIN_THRESH;
+  else if (thresh > MAX_THRESH)
+    thresh = MAX_THRESH;
+  /* The ranges are only split if the throttle asks for it */
+  for (llint start = 0, len; start < st.st_size; start += len)
+    {
+      len = throttle_chunk (st.st_size - start);
+      throttle (len);
+      if (-1 == defrag_file (a->fd, start, len, (uint) thresh))
+        return (EOPNOTSUPP == errno || ENOTTY == errno) ? -2 : -1;
+    }
+  return 0;
+}
+
 int
 shake_reg (struct accused *a, struct law *l)
 {
@@ -293,10 +1398,46 @@ shake_reg (struct accused *a, struct law *l)
     return 0;
 
   capture (a, l);
+  throttle_device (a->fs);
+
+  /* The backends that rewrite the file in place */
+  if (BACKEND_COPY != a->backend)
+    {
+      int res = -2;
+      if (BACKEND_MOVE_EXT == a->backend)
+        res = shake_reg_move_ext (a);
+      else if (BACKEND_SWAPEXT == a->backend)
+        res = shake_reg_swapext (a, l);
+      else if (BACKEND_DEFRAG == a->backend)
+        res = shake_reg_defrag (a, l);
+      if (-2 != res)
+        {
+          if (0 > res)
+            error (0, errno, "%s: in place rewrite failed", accused_name (a));
+          else if (l->xattr && -1 == set_ptime (a->fd))
+            error (0, errno,
+                   "%s: failed to set position time, check user_xattr",
+                   accused_name (a));
+          release (a, l);
+          return res;
+        }
+      /* Falls back on copying, which needs the lock we didn't take */
+      a->backend = BACKEND_COPY;
+      if (l->locks)
+        {
+          if (-1 == readlock_file (a->fd, accused_name (a)))
+            {
+              error (0, errno, "%s: failed to acquire a lock", accused_name (a));
+              release (a, l);
+              return -1;
+            }
+          a->locks = true;
+        }
+    }
 
   if (0 > shake_reg_backup_phase (a, l))
     {
-      error (0, errno, "%s: temporary copy failed", a->name);
+      error (0, errno, "%s: temporary copy failed", accused_name (a));
       release (a, l);
       return -1;
     }
@@ -304,16 +1445,18 @@ shake_reg (struct accused *a, struct law *l)
   /* Tries acquiring a write lock and then to copy the backup over the
    * original.
    */
-  if (!(l->locks && 0 > readlock_to_writelock (a->fd)))
+  if (a->locks && 0 > readlock_to_writelock (a->fd))
     {
-      shake_reg_rewrite_phase (a, l);
-      /* Updates position time */
-      if (l->xattr && -1 == set_ptime (a->fd))
-        {
-          error (0, errno,
-                 "%s: failed to set position time, check user_xattr",
-                 a->name);
-        }
+      release (a, l);
+      return -1;                // the lock was canceled, a->fd is untouched
+    }
+  shake_reg_rewrite_phase (a, l);
+  /* Updates position time */
+  if (l->xattr && -1 == set_ptime (a->fd))
+    {
+      error (0, errno,
+             "%s: failed to set position time, check user_xattr",
+             accused_name (a));
     }
 
   release (a, l);
@@ -321,160 +1464,212 @@ shake_reg (struct accused *a, struct law *l)
   return 0;
 }
 
-/*  For use by qsort().
+/* A list being read by list_dir() or list_stdin(). The names are
+ * appended to one arena, and become one block in list_finish().
+ */
+struct list_builder
+{
+  char *names;                  // '\0' terminated names
+  size_t names_len;
+  size_t names_size;
+  size_t *offsets;              // of each name in names
+  ino_t *inos;                  // of each name, 0 if unknown
+  uint n;
+  uint n_size;
+};
+
+/* Appends "dir/name", or just "name" if dir is NULL, to the list.
+ * Returns -1 if failed.
  */
 static int
-atimesort (const void *a, const void *b)
-{
-  assert (a && b);
-  /* Cast *a and *b */
-  char *aname = *((char *const *) a);
-  char *bname = *((char *const *) b);
-  assert (aname && bname);
-  /* Get atimes */
-  struct stat astat;
-  struct stat bstat;
-  if (-1 == stat (aname, &astat) || -1 == stat (bname, &bstat))
-    {
-      /*  If we abort here, it will be a DoS caused by a race condition.
-       * So vomit a cryptic error message and go on.
-       */
-#ifdef DEBUG
-      error (0, errno, "stat() of %s or %s failed", aname, bname);
-#endif
-      return 0;
+list_add (struct list_builder *b, const char *dir, size_t dirl,
+          const char *name, ino_t ino)
+{
+  const size_t BUFFSTEP = 64 * 1024;
+  size_t namel = strlen (name) + 1;
+  size_t len = dir ? dirl + 1 + namel : namel;
+  /* Do the buffers need to be extended ? */
+  if (b->names_len + len > b->names_size)
+    {
+      size_t nsize = b->names_size * 2 + len + BUFFSTEP;
+      char *nnames = realloc (b->names, nsize);
+      if (!nnames)
+        return -1;
+      b->names = nnames;
+      b->names_size = nsize;
+    }
+  if (b->n == b->n_size)
+    {
+      uint nsize = b->n_size * 2 + 128;
+      size_t *noffsets = realloc (b->offsets, nsize * sizeof (*noffsets));
+      if (noffsets)
+        b->offsets = noffsets;
+      ino_t *ninos = realloc (b->inos, nsize * sizeof (*ninos));
+      if (ninos)
+        b->inos = ninos;
+      if (!noffsets || !ninos)
+        return -1;
+      b->n_size = nsize;
+    }
+  /* store the complete path relative to cwd */
+  b->offsets[b->n] = b->names_len;
+  b->inos[b->n] = ino;
+  if (dir)
+    {
+      memcpy (b->names + b->names_len, dir, dirl);
+      b->names[b->names_len + dirl] = '/';
+      b->names_len += dirl + 1;
     }
-  // Using modulo to prevent int overflow
-  return (int) ((bstat.st_atime - astat.st_atime) % 2);
+  memcpy (b->names + b->names_len, name, namel);
+  b->names_len += namel;
+  b->n++;
+  return 0;
+}
+
+/* Returns the list as an array of names, followed by NULL and by the
+ * names themselves, all in one block that close_list() frees.
+ * The names are sorted relative to dirfd.
+ * Frees the builder, returns NULL if failed.
+ */
+static char **
+list_finish (struct list_builder *b, int dirfd, enum order order)
+{
+  size_t ptrs_len = (b->n + 1) * sizeof (char *);
+  char **flist = malloc (ptrs_len + b->names_len);
+  if (flist)
+    {
+      char *names = (char *) flist + ptrs_len;
+      if (b->names_len)
+        memcpy (names, b->names, b->names_len);
+      for (uint i = 0; i < b->n; i++)
+        flist[i] = names + b->offsets[i];
+      /* A NULL entry will mark the end of the buffer */
+      flist[b->n] = NULL;
+      sort_list (flist, b->inos, b->n, dirfd, order);
+    }
+  free (b->names);
+  free (b->offsets);
+  free (b->inos);
+  return flist;
 }
 
 char **
-list_dir (char *name, int sort)
-{
-  assert (name);
-  const size_t BUFFSTEP = 128;
-  size_t namel = strlen (name);
-  /* Read entries one by one and store their name in a buffer */
-  uint n = 0;
-  char **buff = malloc (sizeof (*buff) * BUFFSTEP);
+list_dir (int fd, const char *prefix, enum order order, uint max)
+{
+  assert (fd > -1);
+  const size_t BUFFSIZE = 64 * 1024;    // Bytes read per system call
+  const char *name = prefix ? prefix : ".";     // for messages
+  struct list_builder b = {
+    .names = NULL,
+  };
+  size_t prefixl = prefix ? strlen (prefix) : 0;
+  char *buff;
+  char **flist;
+  buff = malloc (BUFFSIZE);
   if (!buff)
     {
       error (0, errno, "%s: malloc() failed", name);
       return NULL;
     }
-  buff[0] = NULL;
-  struct dirent *ent = NULL;
-  DIR *dir = opendir (name);
-  if (!dir)
+  /* Read entries by large batches and store their names in the list */
+  for (bool done = false; !done;)
     {
-      error (0, errno, "%s: opendir() failed", name);
-      return NULL;
-    }
-  for (n = 0; (ent = readdir (dir)); n++)
-    {
-      char *dname = ent->d_name;
-      char *fname;              // full name
-      if (n == INT_MAX)
-        {
-          error (0, 0, "%s: more than %u files", name, INT_MAX - 1);
-          break;
-        }
-      /* ignore "." and ".." */
-      if (0 == strcmp (dname, ".") || 0 == strcmp (dname, ".."))
-        {
-          n--;
-          continue;
-        }
-      /* Does the buffer need to be extended ? */
-      if (!((n + 2) % BUFFSTEP))        // + 1 for buff[n], + 1 for buff[n+1]=NULL
+      ssize_t len = read_dir_entries (fd, buff, BUFFSIZE);
+      if (-1 == len)
+        error (0, errno, "%s: getdents64() failed", name);
+      if (0 >= len)
+        break;
+      for (ssize_t pos = 0; pos < len && !done;)
         {
-          char **nbuff = realloc (buff, (n + 2 + BUFFSTEP) * sizeof (*buff));
-          if (!nbuff)
+          struct dirent64 *ent = (struct dirent64 *) (buff + pos);
+          char *dname = ent->d_name;
+          pos += ent->d_reclen;
+          /* ignore "." and ".." */
+          if (0 == strcmp (dname, ".") || 0 == strcmp (dname, ".."))
+            continue;
+          /*  Only regular files and directories can be shaked, so the
+           * others needn't be stat()ed. investigate() checks the type
+           * of the DT_UNKNOWN ones.
+           */
+          if (DT_REG != ent->d_type && DT_DIR != ent->d_type
+              && DT_UNKNOWN != ent->d_type)
+            continue;
+          if (b.n == INT_MAX - 1)
+            {
+              error (0, 0, "%s: more than %u files", name, INT_MAX - 1);
+              done = true;
+            }
+          else if (-1 == list_add (&b, prefix, prefixl, dname,
+                                   (ino_t) ent->d_ino))
             {
               error (0, errno, "%s: realloc() failed", name);
-              break;
+              done = true;
+            }
+          /*  Leave the next entries for the next call, getdents64()
+           * will then start after this one.
+           */
+          if (!done && max && b.n == max)
+            {
+              if (-1 == lseek (fd, (off_t) ent->d_off, SEEK_SET))
+                error (0, errno, "%s: lseek() failed", name);
+              done = true;
             }
-          buff = nbuff;
-        }
-      /* get and store the complete path relative to cwd */
-      fname = malloc (namel + strlen (dname) + 2);
-      if (!fname)
-        {
-          error (0, errno, "%s: malloc() failed", name);
-          /* Try with the next file */
-          n--;
-          continue;
         }
-      strcpy (fname, name);
-      fname[namel] = '/';
-      strcpy (fname + namel + 1, dname);
-      buff[n] = fname;
     }
-  /* They are some breaks in the for loop */
-  if (sort)
-    qsort (buff, n, sizeof (*buff), &atimesort);
-  /* A NULL entry will mark the end of the buffer */
-  buff[n] = NULL;
-  closedir (dir);
-  return buff;
+  free (buff);
+  flist = list_finish (&b, prefix ? AT_FDCWD : fd, order);
+  if (!flist)
+    error (0, errno, "%s: malloc() failed", name);
+  return flist;
 }
 
 char **
-list_stdin (void)
+list_stdin (enum order order, char delim, uint max)
 {
-  const size_t BUFFSTEP = 32;
-  uint n = 0;
+  struct list_builder b = {
+    .names = NULL,
+  };
   size_t len = 0;
+  ssize_t read;
   char *line = NULL;
-  char **buff = malloc (BUFFSTEP * sizeof (*buff));
-  if (!buff)
-    error (1, errno, "-: malloc() failed");
-  /* for each line */
-  for (; -1 != getline (&line, &len, stdin); line = NULL, len = 0)
+  char **flist;
+  /* for each name, until max of them */
+  while ((!max || b.n < max) && -1 != (read = getdelim (&line, &len, delim,
+                                                         stdin)))
     {
-      if (n == INT_MAX)
+      if (b.n == INT_MAX - 1)
         {
           error (0, 0, "-: more than %i files", INT_MAX - 1);
+          free (line);
+          free (list_finish (&b, AT_FDCWD, ORDER_NONE));
           return NULL;
         }
-      /* remove the end of line */
-      *strchrnul (line, '\n') = '\0';
-      /* Does the buffer need to be extended ? */
-      if (!((n + 2) % BUFFSTEP))        // + 1 for buff[n], + 1 for buff[n+1]=NULL
-        {
-          char **nbuff = realloc (buff, (n + 2 + BUFFSTEP) * sizeof (*buff));
-          if (!nbuff)
-            {
-              error (0, errno, "s: realloc() failed");
-              close_list (buff);
-              free (line);
-              return NULL;
-            }
-          buff = nbuff;
-        }
+      /* remove the delimiter */
+      if (read && delim == line[read - 1])
+        line[read - 1] = '\0';
       /* Ignore "" */
       if ('\0' == *line)
+        continue;
+      /* Add the line into the list */
+      if (-1 == list_add (&b, NULL, 0, line, 0))
         {
+          error (0, errno, "-: realloc() failed");
           free (line);
-          continue;
+          free (list_finish (&b, AT_FDCWD, ORDER_NONE));
+          return NULL;
         }
-      /* Add the line into the buffer */
-      buff[n] = line;
-      n++;
     }
   free (line);
-  /* A NULL entry will mark the end of the buffer */
-  buff[n] = NULL;
-  if (n)
-    qsort (buff, n - 1, sizeof (*buff), &atimesort);
-  return buff;
+  flist = list_finish (&b, AT_FDCWD, order);
+  if (!flist)
+    error (0, errno, "-: malloc() failed");
+  return flist;
 }
 
 void
 close_list (char **flist)
 {
   assert (flist);
-  for (char **oflist = flist; *oflist; oflist++)
-    free (*oflist);
+  // The names are in the same block, see list_finish()
   free (flist);
 }
@@ -24,6 +24,11 @@
 /*  Copy the content of file referenced by in_fd to out_fd
  *  Make file sparse if there's more than gap consecutive '\0',
  * and if gap != 0
+ *  If gap == 0 datas are moved by the kernel (copy_file_range() or
+ * splice()); some filesystems then share extents instead of writing
+ * new ones, so this is fine for backups but useless for rewrites.
+ *  If direct is true, both files are set O_DIRECT during the copy so
+ * that the page cache is bypassed, unless a filesystem refuses it.
  *  Return -1 and set errno if failed, -2 if canceled, anything else
  *  if succeded
  *  This part is crucial as it is the one which do the job and
@@ -31,34 +36,65 @@
  * so it would be dangerous to rewrite it... however it's
  * big and ugly -_-.
  */
-int fcopy (int in_fd, int out_fd, size_t gap, bool stop_if_input_unlocked);
+int fcopy (int in_fd, int out_fd, size_t gap, bool stop_if_input_unlocked,
+           bool direct);
 
-/*  Make a backup of a file, truncate original to 0, then copy
- * the backup over it.
- * This can be called only when the file is *read* locked. It will
- * take a write lock while operating.
+/*  Return the full path of a, for messages. It is built on the first
+ * call, in a buffer that close_case() keeps for the next investigate().
+ */
+const char *accused_name (struct accused *a);
+
+/*  Copies the name of a in a->name, so that a no longer needs the
+ * list its leaf comes from.
+ */
+void adopt_name (struct accused *a);
+
+/*  Return the backend shake_reg() will use for a->fd: l->backend, or the
+ * best one for the filesystem if it is BACKEND_AUTO.
+ */
+enum backend choose_backend (struct accused *a, struct law *l);
+
+/*  Rewrite a file with the backend a->backend.
+ *  With BACKEND_COPY, make a backup of the file, truncate original to 0,
+ * then copy the backup over it.
+ *  With BACKEND_MOVE_EXT, the file is not locked, and the kernel moves
+ * its blocks to a donor file that has been allocated in one go.
+ *  With BACKEND_SWAPEXT, the file is not locked, and is copied to such a
+ * donor file. Then XFS swaps their extents, unless the file has changed.
+ *  With BACKEND_DEFRAG, the file is not locked, and btrfs rewrites its
+ * small extents.
+ *  If the filesystem refuses to do it, falls back to BACKEND_COPY.
+ * With BACKEND_COPY, this can be called only when the file is *read*
+ * locked. It will take a write lock while operating.
  * This can be called only when in NORMAL mode. It internally set the
  * CRITICAL mode but goes back in NORMAL mode before returning.
+ * Returns a negative value if the file wasn't rewritten, else 0.
  */
 int shake_reg (struct accused *a, struct law *l);
 
 
-/* Return an array containing file names in the named directory,
- * excepted "." and "..".
+/* Return an array containing file names in the directory fd,
+ * excepted "." and ".." and entries that are neither regular files nor
+ * directories.
+ * Names are relative to fd, or to the cwd if prefix is the path of fd:
+ * they are then "prefix/name".
+ * At most max names are returned unless max is 0, the next call then
+ * returns the following ones. The array is empty once fd is exhausted.
  * Return NULL in case of error.
- * If sort is true, file names are sorted by atime.
- * LIMIT : INT_MAX files
+ * File names are sorted according to order, see sort_list().
+ * LIMIT : INT_MAX files per call
  */
-char **list_dir (char *name, int sort);
+char **list_dir (int fd, const char *prefix, enum order order, uint max);
 
-/* Return an array containing file names given in stdin
- * excepted "." and "..".
- * File names are sorted by atime.
+/* Return an array containing the next file names given in stdin,
+ * separated by delim, at most max of them unless max is 0.
+ * The array is empty once stdin is exhausted.
+ * File names are sorted according to order, see sort_list().
  * LIMIT : INT_MAX files
  */
-char **list_stdin (void);
+char **list_stdin (enum order order, char delim, uint max);
 
-/* Free arrays allocated by list_dir()
+/* Free arrays allocated by list_dir() or list_stdin()
  */
 void close_list (char **flist);
 #endif
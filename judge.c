@@ -31,153 +31,355 @@
 #include <stdio.h>              // printf(), tmpfile()
 #include <error.h>              // error()
 #include <limits.h>             // SSIZE_MAX
-#include "executive.h"          // fcopy()
+#include <sys/resource.h>       // getrlimit()
+#include <pthread.h>
+#include "executive.h"          // fcopy(), choose_backend()
 #include "judge.h"
 #include "linux.h"
 #include "msg.h"
+#include "walker.h"             // walk_list()
+#include "probe.h"              // prober_open()
+#include "visited.h"            // visit()
+#include "throttle.h"           // throttle_pause(), throttle_quiet()
+#include "rank.h"               // rank_add(), rank_pop()
 
-struct accused *
-investigate (char *name, struct law *l)
+/*  This function tell return the tolerance, that is a number
+ * corresponding to the cost of shake()ing a file of this size.
+ *  It is used by judge().
+ */
+static double
+tol_reg (off_t size, struct law *l)
 {
-  assert (name);
-  struct accused *a;
-  ino_t inode;                  // used to check against race between open and stat
-  /* malloc() */
-  {
-    a = malloc (sizeof (*a));
-    if (NULL == a)
-      error (1, errno, "%s: malloc() failed", name);
-    a->name = strdup (name);
-    if (NULL == a->name)
-      error (1, errno, "%s: strdup() failed", name);
-  }
-  /* Set default value */
-  {
-    a->fd = -1;
-    a->blocks = 0;
-    a->fragc = 0;
-    a->crumbc = 0;
-    a->start = 0;
-    a->end = 0;
-    a->ideal = 0;
-    a->atime = 0;
-    a->mtime = 0;
-    a->age = 0;
-    a->poslog = NULL;
-    a->sizelog = NULL;
-    a->guilty = 0;
-  }
-  /* this stat() will be applied on all accused, including directory */
-  {
-    struct stat st;
-    if (-1 == lstat (a->name, &st))
-      {
-        error (0, errno, "%s: lstat() failed", name);
-        goto freeall;
-      }
-    a->mode = st.st_mode;
-    a->fs = st.st_dev;
-    a->size = st.st_blocks * 512;
-    inode = st.st_ino;
-  }
-  if (!S_ISREG (a->mode) || 0 == a->size)
-    return a;                   // a->fd is not opened or locked
+  assert (l);
+  double tol = 1.0;
+  if (size < l->smallsize && l->smallsize)
+    tol = l->smallsize_tol;
+  else if (size > l->bigsize && l->bigsize)
+    tol = l->bigsize_tol;
+  return tol;
+}
+
+bool
+needs_open (off_t size, time_t ctime, struct law *l)
+{
+  assert (l);
+  double tol = tol_reg (size, l);
+  // With -vv, every file is shown with all its details
+  if (l->verbosity >= 2)
+    return true;
+  if (MAX_TOL == tol)
+    return false;
+  // Without ptime, the age can't grow once the file is opened
+  if (!l->xattr && time (NULL) - ctime < (double) l->new * tol)
+    return false;
+  return true;
+}
+
+bool
+too_new (struct accused *a, struct law *l)
+{
+  assert (a && l);
+  double tol = tol_reg (a->size, l);
+  return S_ISREG (a->mode) && MAX_TOL != tol
+    && a->age < (double) l->new * tol;
+}
+
+/*  Opens a, checks that it is the file stat() saw, chooses its backend
+ * and reads its ptime. Uses what p already opened if it isn't NULL.
+ *  Returns -1 and sets a->stage to STAGE_FAILED if it failed.
+ */
+static int
+open_case (struct accused *a, struct probe *p, struct law *l)
+{
+  assert (a && l);
+  assert (S_ISREG (a->mode));
+  if (STAGE_STAT != a->stage)
+    return STAGE_FAILED == a->stage ? -1 : 0;
   /* open() */
-  if (-1 == (a->fd = open (name, O_NOATIME | O_RDWR)))
+  if (p && (-1 != p->fd || p->open_errno))
     {
-      error (0, errno, "%s: open() failed", name);
-      goto freeall;
+      a->fd = p->fd;
+      p->fd = -1;
+      errno = p->open_errno;
     }
-  /* Puts the lock */
-  // it will be released just before returning
-  if (l->locks && -1 == readlock_file (a->fd, a->name))
+  else
+    a->fd = openat (a->dirfd, a->leaf, O_NOATIME | O_RDWR);
+  if (-1 == a->fd)
     {
-      error (0, errno, "%s: failed to acquire a lock", a->name);
-      goto freeall;
+      error (0, errno, "%s: open() failed", accused_name (a));
+      goto failed;
     }
-  /* This stat() will be applied only on regular files */
+  /* This stat() will be applied only on opened files */
   {
     struct stat st;
     if (-1 == fstat (a->fd, &st))
       {
-        error (0, errno, "%s: fstat() failed", name);
-        goto freeall;
+        error (0, errno, "%s: fstat() failed", accused_name (a));
+        goto failed;
       }
     /* Check against race condition */
-    if (st.st_ino != inode || st.st_dev != a->fs)
+    if (st.st_ino != a->ino || st.st_dev != a->fs)
       {
-        error (0, errno, "%s: file have moved", name);
-        goto freeall;
+        error (0, 0, "%s: file have moved", accused_name (a));
+        goto failed;
       }
     a->size = st.st_blocks * 512;
     a->atime = st.st_atime;
     a->mtime = st.st_mtime;
     a->age = time (NULL) - st.st_ctime;
   }
+  /*  Backends that let the kernel move the blocks are safe even if the
+   * file is accessed meanwhile, so they don't need locks.
+   */
+  a->backend = choose_backend (a, l);
+  a->locks = l->locks && BACKEND_COPY == a->backend;
   /* Read ptime - placement time */
   if (l->xattr)
     {
-      time_t ptime = get_ptime (a->fd);
+      time_t ptime = p && p->has_ptime ? p->ptime : get_ptime (a->fd);
       if (ptime != (time_t) - 1)
         a->age = time (NULL) - ptime;
     }
+  a->stage = STAGE_OPEN;
+  return 0;
+failed:
+  if (-1 != a->fd)
+    close (a->fd);
+  a->fd = -1;
+  a->stage = STAGE_FAILED;
+  return -1;
+}
+
+/*  Reads the block map of a, if it is a regular file and it wasn't read
+ * yet. Returns -1 and sets a->stage to STAGE_FAILED if it failed.
+ */
+static int
+map_case (struct accused *a, struct law *l)
+{
+  assert (a && l);
+  if (STAGE_MAP == a->stage || !S_ISREG (a->mode) || 0 == a->size)
+    return 0;
+  if (-1 == open_case (a, NULL, l))
+    return -1;
   if (-1 == get_testimony (a, l))
+    {
+      a->stage = STAGE_FAILED;
+      return -1;
+    }
+  a->stage = STAGE_MAP;
+  return 0;
+}
+
+/* Number of closed cases kept to be reused */
+#define POOL_SIZE 256
+
+/*  Closed cases, kept with their name and fragment log buffers, so that
+ * a tree of many small files doesn't cost several malloc() per file.
+ * The walker threads investigate too, hence the lock.
+ */
+static struct
+{
+  pthread_mutex_t lock;
+  struct accused *spare[POOL_SIZE];
+  uint sparec;
+} POOL = {
+.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/*  Returns a case from the pool, or a new one
+ */
+static struct accused *
+new_case (const char *leaf)
+{
+  struct accused *a = NULL;
+  pthread_mutex_lock (&POOL.lock);
+  if (POOL.sparec)
+    a = POOL.spare[--POOL.sparec];
+  pthread_mutex_unlock (&POOL.lock);
+  if (a)
+    return a;
+  a = malloc (sizeof (*a));
+  if (NULL == a)
+    error (1, errno, "%s: malloc() failed", leaf);
+  a->name = NULL;
+  a->namesize = 0;
+  a->fraglog = NULL;
+  a->fraglogsize = 0;
+  return a;
+}
+
+/*  Puts a case whose fd is closed back in the pool, or frees it if the
+ * pool is full
+ */
+static void
+drop_case (struct accused *a)
+{
+  a->mode = 0x42;
+  pthread_mutex_lock (&POOL.lock);
+  if (POOL.sparec < POOL_SIZE)
+    {
+      POOL.spare[POOL.sparec++] = a;
+      a = NULL;
+    }
+  pthread_mutex_unlock (&POOL.lock);
+  if (a)
+    {
+      free (a->name);
+      free (a->fraglog);
+      free (a);
+    }
+}
+
+/*  Does investigate(), using what p already read from the kernel if it
+ * isn't NULL. Takes the ownership of p->fd.
+ */
+static struct accused *
+investigate_probed (int dirfd, const char *dir, const char *leaf,
+                    struct probe *p, struct law *l)
+{
+  assert (leaf);
+  assert ((AT_FDCWD == dirfd) == (NULL == dir));
+  struct accused *a;
+  time_t ctime;
+  nlink_t nlink;
+  /* malloc() */
+  {
+    a = new_case (leaf);
+    a->dirfd = dirfd;
+    a->dir = dir;
+    a->leaf = leaf;
+    if (a->name)
+      a->name[0] = '\0';       // built on demand, by accused_name()
+  }
+  /* Set default value */
+  {
+    a->stage = STAGE_STAT;
+    a->fd = -1;
+    a->backend = BACKEND_COPY;
+    a->locks = false;
+    a->ahead = NULL;
+    a->walk = NULL;
+    a->blocks = 0;
+    a->fragc = 0;
+    a->crumbc = 0;
+    a->sharedc = 0;
+    a->start = 0;
+    a->end = 0;
+    a->ideal = 0;
+    a->atime = 0;
+    a->mtime = 0;
+    a->age = 0;
+    a->fraglogc = 0;
+    a->guilty = 0;
+  }
+  /* this stat() will be applied on all accused, including directory */
+  if (p)
+    {
+      if (p->stat_errno)
+        {
+          error (0, p->stat_errno, "%s: lstat() failed", accused_name (a));
+          goto freeall;
+        }
+      a->mode = p->mode;
+      a->fs = p->dev;
+      a->ino = p->ino;
+      a->size = p->blocks * 512;
+      a->atime = p->atime;
+      a->mtime = p->mtime;
+      ctime = p->ctime;
+      nlink = p->nlink;
+    }
+  else
+    {
+      struct stat st;
+      if (-1 == fstatat (dirfd, leaf, &st, AT_SYMLINK_NOFOLLOW))
+        {
+          error (0, errno, "%s: lstat() failed", accused_name (a));
+          goto freeall;
+        }
+      a->mode = st.st_mode;
+      a->fs = st.st_dev;
+      a->ino = st.st_ino;
+      a->size = st.st_blocks * 512;
+      a->atime = st.st_atime;
+      a->mtime = st.st_mtime;
+      ctime = st.st_ctime;
+      nlink = st.st_nlink;
+    }
+  a->age = time (NULL) - ctime;
+  /*  Files with several links, and directories that bind mounts can
+   * show twice, are judged only for their first name
+   */
+  if ((S_ISDIR (a->mode) || (S_ISREG (a->mode) && nlink > 1))
+      && visit (a->fs, a->ino, S_ISDIR (a->mode)))
+    {
+      if (l->verbosity >= 2)
+        error (0, 0, "%s: already visited", accused_name (a));
+      goto freeall;
+    }
+  if (!S_ISREG (a->mode) || 0 == a->size)
+    return a;                   // a->fd is not opened
+  /*  Each step is only taken if the previous ones couldn't tell that
+   * the file is innocent, see judge_reg()
+   */
+  if (!needs_open (a->size, ctime, l))
+    return a;
+  if (-1 == open_case (a, p, l))
+    goto freeall;
+  if (l->verbosity < 2 && a->age < (double) l->new * tol_reg (a->size, l))
+    return a;
+  if (-1 == map_case (a, l))
     goto freeall;
-  unlock_file (a->fd);
   return a;
 freeall:
   {
     if (a->fd != -1)
-      {
-        unlock_file (a->fd);
-        close (a->fd);
-      }
-    free (a->name);
-    free (a);
+      close (a->fd);
+    drop_case (a);
   }
   return NULL;
 }
 
+struct accused *
+investigate (int dirfd, const char *dir, const char *leaf,
+             struct law *l)
+{
+  return investigate_probed (dirfd, dir, leaf, NULL, l);
+}
+
+/*  Closes what the walker prepared in advance for the directory a, see
+ * walker.h
+ */
+static void
+drop_ahead (struct accused *a, struct law *l)
+{
+  if (!a->walk)
+    return;
+  walk_close (a->walk, l);
+  close_list (a->ahead);
+  close (a->fd);
+  a->walk = NULL;
+  a->ahead = NULL;
+  a->fd = -1;
+}
+
 void
 close_case (struct accused *a, struct law *l)
 {
+  assert (l);
   if (!a)
     return;
+  drop_ahead (a, l);
   if (a->fd >= 0)
     {
       // We ignore the case where the file is already unlocked
       // because it is legitimate when eg. there were concurent
       // accesses
-      if (l->locks)
+      if (a->locks)
         unlock_file (a->fd);
       close (a->fd);
     }
-  free (a->name);
-  a->name = NULL;
   a->fd = -1;
-  a->mode = 0x42;
-  if (a->poslog)
-    free (a->poslog);
-  if (a->sizelog)
-    free (a->sizelog);
-  free (a);
-}
-
-/*  This function tell return the tolerance, that is a number
- * corresponding to the cost of shake()ing the accused.
- *  It is used by judge().
- */
-static double
-tol_reg (struct accused *a, struct law *l)
-{
-  assert (a && l);
-  assert (S_ISREG (a->mode));
-  double tol = 1.0;
-  if (a->size < l->smallsize && l->smallsize)
-    tol = l->smallsize_tol;
-  else if (a->size > l->bigsize && l->bigsize)
-    tol = l->bigsize_tol;
-  return tol;
+  drop_case (a);
 }
 
 /* Return true if the file is fragmented, else false.
@@ -187,9 +389,17 @@ judge_reg (struct accused *a, struct law *l)
 {
   assert (a && l);
   assert (S_ISREG (a->mode));
-  double tol = tol_reg (a, l);
+  double tol = tol_reg (a->size, l);
   if (MAX_TOL == tol)
     return false;
+  /* investigate() stops as soon as it knows the file is innocent */
+  if (STAGE_MAP != a->stage)
+    return false;
+  /*  Extents shared with snapshots or reflinks would be duplicated by
+   * any rewrite, using more space for no gain
+   */
+  if (a->sharedc)
+    return false;
   if (a->age < (double) l->new * tol)
     return false;
   if (a->age > (double) l->old * tol)
@@ -204,78 +414,179 @@ judge_reg (struct accused *a, struct law *l)
   return false;
 }
 
-/*  This function call judge on the list content
+/*  The number of directories judge_dir() keeps open (only the main
+ * thread judges)
+ */
+static uint OPEN_DIRS = 0;
+
+/*  Returns how many directories judge_dir() can keep open. Each level
+ * also keeps the 3 files of window_feed() open, plus the ones the walker
+ * or the prober opened in advance, and the rest of the fds are left to
+ * the backends and to the directories the walker lists in advance.
+ */
+static uint
+max_open_dirs (void)
+{
+  const rlim_t RESERVED = 64 + MAX_JOBS + walker_ahead ();
+  static uint max = 0;
+  if (!max)
+    {
+      struct rlimit rl;
+      rlim_t per_level = 4 + (walker_window ()? walker_window ()
+                              : PROBE_BATCH);
+      rlim_t usable = 4096 * per_level;
+      /* We don't use select(), so we can take all the fds we may */
+      if (0 == getrlimit (RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max)
+        {
+          rl.rlim_cur = rl.rlim_max;
+          setrlimit (RLIMIT_NOFILE, &rl);
+        }
+      if (0 == getrlimit (RLIMIT_NOFILE, &rl)
+          && RLIM_INFINITY != rl.rlim_cur && rl.rlim_cur < usable + RESERVED)
+        usable = rl.rlim_cur > RESERVED + per_level
+          ? rl.rlim_cur - RESERVED : per_level;
+      max = (uint) (usable / per_level);
+    }
+  return max;
+}
+
+/*  Returns the result of investigate() for flist[n], that the walker
+ * may have prepared if w isn't NULL, or using the probes of pr if it
+ * isn't NULL.
+ */
+static struct accused *
+summon (struct walk *w, struct prober *pr, char *restrict * flist, uint n,
+        int dirfd, const char *dir, struct law *l)
+{
+  if (w)
+    return walk_result (w, n);
+  return investigate_probed (dirfd, dir, flist[n],
+                             pr ? prober_get (pr, n) : NULL, l);
+}
+
+/*  The files judged by window_feed(): "y" the one being judged, "x" the
+ * previous one, and eventually "z" the next one (to take neighboors in
+ * account). A window can go through several lists, see judge_stdin().
+ */
+struct window
+{
+  struct accused *x, *y;
+};
+
+/*  Makes z the file after y, NULL if y is the last one, then judges y
+ * now that its neighboors are known.
+ */
+static int
+window_push (struct window *win, struct accused *z, struct law *l)
+{
+  struct accused *x = win->x, *y = win->y;
+  int res = 0;
+  if (y)
+    {
+      /* Do we know where the file should be ? */
+      bool left, right;
+      y->ideal = 0;
+      /* Ideal file order: x->start < y->start < z->start
+       *                              ^^^^^^^^
+       *                          File to be moved
+       *  y->start is only known if y wasn't found innocent, and then
+       * the neighbours may need to be mapped.
+       */
+      if (y->start)
+        {
+          left = x && labs (x->atime - y->atime) < MAGICTIME
+            && -1 != map_case (x, l) && x->end;
+          right = z && labs (z->atime - y->atime) < MAGICTIME
+            && -1 != map_case (z, l) && z->start;
+          if (left && right)
+            /* place the middle file between the left and right file */
+            y->ideal = (x->end + z->start + MAGICLEAP - y->size) / 2;
+          else if (left)
+            /* place the middle file directly after the left file */
+            y->ideal = (x->end + MAGICLEAP);
+          else if (right)
+            /* place the middle file directly in front of the right file */
+            y->ideal = (z->start - y->size - MAGICLEAP);
+        }
+      /* judge */
+      res = judge (y, l);
+    }
+  close_case (x, l);
+  win->x = y;
+  win->y = z;
+  return res;
+}
+
+/*  Makes the files of the window own their name, so that they can
+ * outlive the list they come from.
+ */
+static void
+window_adopt (struct window *win)
+{
+  if (win->x)
+    adopt_name (win->x);
+  if (win->y)
+    adopt_name (win->y);
+}
+
+/*  Closes the files of the window, without judging them
+ */
+static void
+window_clear (struct window *win, struct law *l)
+{
+  close_case (win->x, l);
+  close_case (win->y, l);
+  win->x = win->y = NULL;
+}
+
+/*  Pushes the content of the list in the window, the last file stays
+ * in it to be judged with the next list, or as the last one.
+ *  w is the walk of flist if the walker started it in advance, else
+ * NULL. It is closed.
  */
 static int
-judge_list (char *restrict * flist, struct law *restrict l)
+window_feed (struct window *win, char *restrict * flist, int dirfd,
+             const char *dir, struct walk *w, struct law *restrict l)
 {
-  assert (flist && l);
+  assert (win && flist && l);
   int res = 0;                  // value returned
-  /*  We want "y", to be the file examined, "x" the previous one, and
-   * eventually "z" the next one (to take neighboors in account).
-   */
-  struct accused *x = NULL, *y = NULL, *z = NULL;
+  struct prober *pr = NULL;
   /* check if list is empty */
   if (!flist[0])
     return 0;
-  /* Main loop, read every file and their neighboor
-   * Typically, x:flist[n-1], y: flist[n], z: flist[n+1]
+  /*  Investigate in advance, if we have threads, else in batches. But
+   * not past the depth where judge_dir() stops keeping fds open.
    */
-  z = investigate (flist[0], l);
+  if (!w && (AT_FDCWD != dirfd || !OPEN_DIRS))
+    {
+      uint max = max_open_dirs ();
+      w = walk_list (flist, dirfd, dir,
+                     max > OPEN_DIRS ? max - OPEN_DIRS : 0);
+      if (!w)
+        pr = prober_open (flist, dirfd, l);
+    }
+  /* Main loop, files that can't be investigated are skipped */
   for (uint n = 0; flist[n]; n++)
     {
-      /* Do we have a file after y ? */
-      if (z)
+      struct accused *z;
+      throttle_pause ();
+      /* Files found once the deadline has come couldn't be shaken */
+      if (l->ranked && l->deadline && time (NULL) >= l->deadline)
         {
-          close_case (x, l);
-          x = y;
-          y = z;
+          res = -1;
+          break;
         }
-      /* Try to add a file from the list */
-      if (flist[n + 1])
-        {
-          z = investigate (flist[n + 1], l);
-          if (!z)
-            continue;           // Try the next file.
-        }
-      else
-        z = NULL;
-      /* Do we actually have a file ? */
-      if (!y)
-        continue;
-      /* Do we know where the file should be ? */
-      {
-        y->ideal = 0;
-        /* Ideal file order: x->start < y->start < z->start
-         *                              ^^^^^^^^
-         *                          File to be moved
-         */
-        if (y->start)
-          {
-            if (x && x->end && labs (x->atime - y->atime) < MAGICTIME)
-              {
-                if (z && z->start && labs (z->atime - y->atime) < MAGICTIME)
-                  /* place the middle file between the left and right file */
-                  y->ideal = (x->end + z->start + MAGICLEAP - y->size) / 2;
-                else
-                  /* place the middle file directly after the left file */
-                  y->ideal = (x->end + MAGICLEAP);
-              }
-            else if (z && z->start && labs (z->atime - y->atime) < MAGICTIME)
-              /* place the middle file directly in front of the right file */
-              y->ideal = (z->start - y->size - MAGICLEAP);
-          }
-      }
-      /* judge */
-      if (-1 == judge (y, l))
+      z = summon (w, pr, flist, n, dirfd, dir, l);
+      if (z && -1 == window_push (win, z, l))
         {
           res = -1;
           break;
         }
     }
-  close_case (x, l);
-  close_case (y, l);
-  close_case (z, l);
+  if (w)
+    walk_close (w, l);
+  if (pr)
+    prober_close (pr);
   return res;
 }
 
@@ -284,22 +595,95 @@ judge_list (char *restrict * flist, struct law *restrict l)
 static int
 judge_dir (struct accused *a, struct law *l)
 {
-  assert (a && a->name && l);
+  assert (a && a->leaf && l);
   assert ((dev_t) - 1 != a->fs);
   /* check against --one-file-system */
   if ((dev_t) - 1 != l->kingdom && a->fs != l->kingdom)
     return 0;
   else
     {
-      int res;
-      char **flist = list_dir (a->name, true);
-      if (!flist)
+      int res = 0;
+      char **flist;
+      char **ahead = NULL;      // first names, listed by the walker
+      struct walk *w = NULL;    // their investigation
+      bool relative;            // are flist names relative to fd ?
+      uint chunk;               // names read at once, 0 for all
+      struct window win = { NULL, NULL };
+      int fd;
+      /*  The files are opened relative to fd, so that the kernel doesn't
+       * walk the whole path for each of them. But fd stays open while
+       * subdirectories are judged, so past a depth we use full paths,
+       * and close fd once the directory is read.
+       *  With --reorder, the directory is read, sorted and judged by
+       * chunks, so fd has to stay open until the last one is read: past
+       * that depth it is read whole instead, as without --reorder.
+       */
+      relative = OPEN_DIRS < max_open_dirs ();
+      /* The walker may have opened and listed it already */
+      if (relative && a->walk)
         {
-          error (0, 0, "%s: list_dir() failed", a->name);
-          return -1;
+          fd = a->fd;
+          ahead = a->ahead;
+          w = a->walk;
+          a->fd = -1;
+          a->ahead = NULL;
+          a->walk = NULL;
+          walk_adopt (w);
         }
-      res = judge_list (flist, l);
-      close_list (flist);
+      else
+        {
+          drop_ahead (a, l);
+          fd = openat (a->dirfd, a->leaf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+          if (-1 == fd)
+            {
+              error (0, errno, "%s: open() failed", accused_name (a));
+              return -1;
+            }
+        }
+      if (relative)
+        OPEN_DIRS++;
+      chunk = relative ? l->reorder : 0;
+      while (true)
+        {
+          if (ahead)
+            flist = ahead;
+          else
+            flist = list_dir (fd, relative ? NULL : accused_name (a),
+                              l->order, chunk);
+          ahead = NULL;
+          if (!flist)
+            {
+              error (0, 0, "%s: list_dir() failed", accused_name (a));
+              res = -1;
+              break;
+            }
+          if (!flist[0])
+            break;
+          if (!relative)
+            {
+              close (fd);
+              fd = -1;
+            }
+          if (relative)
+            res = window_feed (&win, flist, fd, accused_name (a), w, l);
+          else
+            res = window_feed (&win, flist, AT_FDCWD, NULL, NULL, l);
+          w = NULL;
+          /* The last list has to outlive the window */
+          if (-1 == res || !chunk)
+            break;
+          window_adopt (&win);
+          close_list (flist);
+        }
+      if (-1 != res)
+        res = window_push (&win, NULL, l);
+      window_clear (&win, l);
+      if (flist)
+        close_list (flist);
+      if (relative)
+        OPEN_DIRS--;
+      if (-1 != fd)
+        close (fd);
       return res;
     }
 }
@@ -308,15 +692,36 @@ int
 judge_stdin (struct accused *a, struct law *l)
 {
   assert (!a && l);
-  int res;
-  char **flist = list_stdin ();
-  if (!flist)
+  struct window win = { NULL, NULL };
+  char **flist;
+  int res = 0;
+  /*  With a reorder buffer, names are read, sorted and judged by
+   * batches, so that the memory used doesn't depend on the length of
+   * the list.
+   */
+  while (true)
     {
-      error (0, 0, "-: list_stdin() failed");
-      return -1;
+      flist = list_stdin (l->order, l->delim, l->reorder);
+      if (!flist)
+        {
+          error (0, 0, "-: list_stdin() failed");
+          res = -1;
+          break;
+        }
+      if (!flist[0])
+        break;
+      res = window_feed (&win, flist, AT_FDCWD, NULL, NULL, l);
+      /* The last list has to outlive the window */
+      if (-1 == res || !l->reorder)
+        break;
+      window_adopt (&win);
+      close_list (flist);
     }
-  res = judge_list (flist, l);
-  close_list (flist);
+  if (-1 != res)
+    res = window_push (&win, NULL, l);
+  window_clear (&win, l);
+  if (flist)
+    close_list (flist);
   return res;
 }
 
@@ -324,6 +729,7 @@ judge_stdin (struct accused *a, struct law *l)
 int
 judge (struct accused *a, struct law *l)
 {
+  bool shaken = false;
   assert (a && l);
   if (S_ISLNK (a->mode))
     return 0;
@@ -331,41 +737,119 @@ judge (struct accused *a, struct law *l)
     return judge_dir (a, l);
   else if (S_ISREG (a->mode) && a->size)
     {
-      /* Take the lock, it will be released just before returning */
-      if (l->locks && -1 == readlock_file (a->fd, a->name))
+      bool guilty = judge_reg (a, l);
+      /* With a budget, guilty files are shaken later by judge_ranked() */
+      if (guilty && l->ranked)
         {
-          error (0, errno, "%s: failed to acquire a lock", a->name);
-          return 0;
+          if (-1 == rank_add (a, l))
+            error (0, errno, "%s: failed to rank", accused_name (a));
         }
-      /* Check against modification */
-      {
-        struct stat st;
-        if (-1 == fstat (a->fd, &st))
-          {
-            error (0, errno, "%s: lstat() failed", a->name);
-            goto freeall;
-          }
-        if (st.st_blocks * 512 != a->size
-            || st.st_mtime != a->mtime || st.st_mode != a->mode)
+      /* Judge, only the guilty files are locked */
+      else if (guilty)
+        {
+          /* Wait for the disk to be idle, without holding the lock */
+          if (!l->pretend
+              && 1 == throttle_quiet (a->fs, BACKEND_COPY == a->backend
+                                      ? 2 * a->size : a->size))
+            {
+              error (0, 0, "%s: no idle window long enough",
+                     accused_name (a));
+              return 0;
+            }
+          /* Take the lock, it will be released just before returning */
+          if (a->locks && -1 == readlock_file (a->fd, accused_name (a)))
+            {
+              error (0, errno, "%s: failed to acquire a lock",
+                     accused_name (a));
+              return 0;
+            }
+          /* Check against modification since investigate() */
           {
-            error (0, 0, "%s: concurrent access", a->name);
-            goto freeall;
+            struct stat st;
+            if (-1 == fstat (a->fd, &st))
+              {
+                error (0, errno, "%s: lstat() failed", accused_name (a));
+                goto freeall;
+              }
+            if (st.st_blocks * 512 != a->size
+                || st.st_mtime != a->mtime || st.st_mode != a->mode)
+              {
+                error (0, 0, "%s: concurrent access", accused_name (a));
+                goto freeall;
+              }
           }
-      }
-      /* Judge and maybe shake */
-      a->guilty = judge_reg (a, l);
-      if (a->guilty)
-        shake_reg (a, l);
-      /* Unlock */
-      unlock_file (a->fd);
+          /* Shake */
+          a->guilty = true;
+          shaken = 0 <= shake_reg (a, l);
+          /* Unlock */
+          unlock_file (a->fd);
+        }
       /*  Show result of investigation, if the file is guilty or if
        * level of verbosity is greater than 2
        */
       if ((a->guilty && l->verbosity) || l->verbosity >= 2)
         show_reg (a, l);
     }
-  return a->guilty;
+  return shaken;
 freeall:
   unlock_file (a->fd);
   return 0;
 }
+
+int
+judge_ranked (struct law *l)
+{
+  struct candidate c;
+  llint done = 0;               // bytes rewritten
+  time_t begin = time (NULL);
+  assert (l);
+  l->ranked = false;
+  /* The first pass visited the inodes that have several links */
+  forget_visits ();
+  while (rank_pop (&c))
+    {
+      time_t now = time (NULL);
+      struct accused *a;
+      if (l->deadline && now >= l->deadline)
+        {
+          if (l->verbosity)
+            error (0, 0, "deadline reached, %zu files left unshaken",
+                   rank_count () + 1);
+          do
+            free (c.name);
+          while (rank_pop (&c));
+          break;
+        }
+      /*  Files over the budget are skipped, as smaller ones may fit. So
+       * are those that wouldn't be done by the deadline at the rate seen
+       * so far.
+       */
+      if ((l->max_bytes && done + c.size > l->max_bytes)
+          || (l->deadline && done && now > begin
+              && (double) c.size * (double) (now - begin) / (double) done
+              > (double) (l->deadline - now)))
+        {
+          if (l->verbosity >= 2)
+            error (0, 0, "%s: over the budget", c.name);
+          free (c.name);
+          continue;
+        }
+      a = investigate (AT_FDCWD, NULL, c.name, l);
+      if (a && a->fs == c.fs && a->ino == c.ino && a->mtime != c.mtime)
+        {
+          if (l->verbosity >= 2)
+            error (0, 0, "%s: modified since ranked", c.name);
+        }
+      else if (a)
+        {
+          if (a->fs == c.fs && a->ino == c.ino)
+            a->ideal = c.ideal;
+          if (judge (a, l))
+            done += a->size;
+        }
+      if (a)
+        close_case (a, l);
+      free (c.name);
+    }
+  return 0;
+}
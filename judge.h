@@ -42,6 +42,32 @@ typedef long long int llint;
  */
 #define MAX_TOL ( -1.0 )
 
+/*  Max number of threads investigating files (see walker.h)
+ */
+#define MAX_JOBS 32
+
+/* The ways shake_reg() can rewrite a file
+ */
+enum backend
+{
+  BACKEND_AUTO,			// choose from the filesystem type
+  BACKEND_COPY,			// backup, truncate and copy back
+  BACKEND_MOVE_EXT,		// ext4 swaps the blocks with a donor file
+  BACKEND_SWAPEXT,		// XFS swaps the extents with a copy
+  BACKEND_DEFRAG,		// btrfs defragments the file itself
+};
+
+/* The order in which the files of a directory or of stdin are judged
+ */
+enum order
+{
+  ORDER_NONE,			// as listed
+  ORDER_ATIME,			// most recently accessed first
+  ORDER_NAME,			// lexical order
+  ORDER_INODE,			// inode number, that is inode table order
+  ORDER_PHYSICAL,		// position of the first block on the disk
+};
+
 struct law
 {
   uint maxfragc;		// max number of fragments
@@ -59,52 +85,121 @@ struct law
   bool locks;			// put a lock on written files
   dev_t kingdom;		// file system to examine, ignored if (-1)
   bool xattr;			// use user_xattr
+  bool direct_io;		// bypass the page cache when copying
+  enum backend backend;		// how to rewrite files
+  enum order order;		// how to sort lists of files
+  uint jobs;			// threads investigating files, 0 for none
+  char delim;			// separates names read from stdin
+  uint reorder;			// names of a list sorted together, 0 for all
+  llint max_rate;		// bytes per second copied, 0 for no limit
+  uint max_iops;		// operations per second, 0 for no limit
+  const char *limits_file;	// where to read the two above, or NULL
+  bool idle;			// use the idle I/O class
+  bool adaptive;		// adapt max_rate to the I/O pressure
+  uint quiet_time;		// seconds the disk must be idle, 0 for any
+  bool ranked;			// score the guilty files, see judge_ranked()
+  llint max_bytes;		// bytes judge_ranked() may rewrite, 0 for all
+  time_t deadline;		// when judge_ranked() stops, 0 for never
+  bool watch;			// judge the files written later, see watch.h
   int tmpfd;
   char *tmpname;
 };
 
+/*  How far investigate() went, it stops as soon as it can tell that a
+ * file is innocent. Each stage implies the previous ones.
+ */
+enum stage
+{
+  STAGE_FAILED,			// a later stage failed, the file is left alone
+  STAGE_STAT,			// mode, size, inode and times are known
+  STAGE_OPEN,			// fd is open, backend chosen and age final
+  STAGE_MAP,			// blocks, fragments and position are known
+};
+
+/* A fragment of a file, as logged with -vvv */
+struct fragment
+{
+  llint pos;			// physical position of its first block
+  llint size;
+};
+
 /* The file or directory accused of being fragmented
  * Fields are here in the order they are set.
  */
 struct accused
 {
+  enum stage stage;
   mode_t mode;
-  char *name;
+  int dirfd;			// of its directory, or AT_FDCWD
+  const char *dir;		// path of dirfd, NULL if AT_FDCWD
+  const char *leaf;		// name relative to dirfd
+  char *name;			// full path, NULL or "" until accused_name()
+  size_t namesize;		// allocated for name
   int fd;
+  enum backend backend;		// never BACKEND_AUTO once the file is opened
+  bool locks;			// put a lock on this file
   off_t size;
   long blocks;			// Number of blocks
   uint fragc;			// Number of fragments
   uint crumbc;			// Number of fragments smaller than crumbratio
+  uint sharedc;			// Number of extents shared with other files
   llint start;			// The position of the first block
   llint end;			// The position of the first block
   llint ideal;			// Where the file would idealy start
   time_t atime;			// atime, as returned by stat
   time_t mtime;			// ctime, as returned by stat
   time_t age;			// Min of (atime,ctime,mtime)
-  llint *poslog;		// Tab of fragments positions
-  llint *sizelog;		// Tab of fragments sizes
+  struct fragment *fraglog;	// Fragments, if verbosity >= 3
+  uint fraglogc;		// Number of fragments in fraglog
+  uint fraglogsize;		// allocated for fraglog
   dev_t fs;
+  ino_t ino;
   bool guilty;
+  char **ahead;			// first names of a directory, see walker.h
+  struct walk *walk;		// their investigation, fd is then its fd
 };
 
 /*  This function return a struct wich describe properties
- * of the file who's name is given.
+ * of the file named leaf in the directory dirfd, whose path is dir.
+ * Files that stat() or ptime show innocent are not opened or mapped,
+ * see enum stage.
+ *  dirfd can be AT_FDCWD, dir is then NULL.
+ *  leaf and dir are not copied, they have to outlive the struct.
  */
-struct accused *investigate (char *name, struct law *l);
+struct accused *investigate (int dirfd, const char *dir, const char *leaf,
+                             struct law *l);
+
+/*  Returns true if investigate() has to open a regular file of this
+ * size and ctime, that is if stat() can't tell that it is innocent.
+ */
+bool needs_open (off_t size, time_t ctime, struct law *l);
+
+/*  Returns true if the regular file a is too recent to be judged, given
+ * the tolerance for its size.
+ */
+bool too_new (struct accused *a, struct law *l);
 
 /*  This function free structs allocated by
- * investigate().
+ * investigate(). A few are kept, with their buffers, to be reused.
  */
 void close_case (struct accused *a, struct law *l);
 
 
 
-/*  This function call judge on stdin content
+/*  This function call judge on stdin content, l->reorder names at a
+ * time if it isn't 0
  */
 int judge_stdin (struct accused *a, struct law *l);
 
-/* Return true if the file is fragmented, else false.
+/* Return true if the file was fragmented and shaken, else false.
+ *  If l->ranked, guilty files are only scored, see rank.h.
  */
 int judge (struct accused *a, struct law *l);
 
+/*  Shakes the files judge() scored while l->ranked, best score first,
+ * until l->max_bytes are rewritten or l->deadline has come. Each file
+ * is judged again first, it may have changed since.
+ */
+int judge_ranked (struct law *l);
+
 #endif /* JUDGE_H */
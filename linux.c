@@ -17,11 +17,13 @@
 /*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
 /***************************************************************************/
 
+#include "config.h"
 #include "linux.h"
+#include "executive.h"          // accused_name()
 
 #include <stdlib.h>
 #include <stdio.h>              // snprintf
-#include <limits.h>             // CHAR_BIT
+#include <limits.h>             // CHAR_BIT, PATH_MAX
 #include <time.h>               // time, time_t
 #include <assert.h>             // assert
 #include <errno.h>              // errno
@@ -31,27 +33,41 @@
 #include <unistd.h>             // fcntl()
 #include <sys/ioctl.h>          // ioctl()
 #include <sys/xattr.h>          // fgetxattr(), setxattr()
-#include <linux/fs.h>           // FIBMAP, FIGETBSZ
+#include <string.h>             // memset()
+#include <linux/fs.h>           // FIBMAP, FIGETBSZ, FS_IOC_FIEMAP, FICLONE
+#include <linux/fiemap.h>       // struct fiemap
+#include <linux/btrfs.h>        // BTRFS_IOC_DEFRAG_RANGE
+#include <linux/types.h>        // __u32, __u64
+#include <sys/vfs.h>            // fstatfs()
+#include <libgen.h>             // dirname()
+#ifdef HAVE_XFS_H
+# include <xfs/xfs.h>           // XFS_IOC_SWAPEXT, XFS_IOC_FSBULKSTAT_SINGLE
+#endif
 #include <arpa/inet.h>          // htonl, ntohl
+#include <sys/syscall.h>        // SYS_getdents64
+#include <sys/sysmacros.h>      // major(), minor()
 
 /* The following try to hide Linux-specific leases behind an interface
  * similar to Posix locks.
- * It does a lot of thread-unsafe black magic.
+ * It does a lot of black magic, but no mutex : the signal handler
+ * can't take one.
  */
 
 #define SIGLOCKEXPIRED OS_RESERVED_SIGNAL
-#define MAX_LOCKED_FDS 2        // Never greater than 1
+#define MAX_LOCKED_FDS 2        // Never greater than 1, judge() locks
 
 /* Describe locks
  */
 struct lock_desc
 {
   const char *filename;
-  int fd;
+  int fd;                       // -1 if free, -2 while being registered
   bool write;
 };
 
-/* All the currently managed locks (thread-unsafe, would require a mutex)
+/*  All the currently managed locks. A lock is registered by swapping
+ * the fd of a free entry, with the __atomic builtins, so that the
+ * handler can use it while any thread takes a lock.
  */
 struct lock_desc LOCKS[MAX_LOCKED_FDS];
 
@@ -59,22 +75,16 @@ struct lock_desc LOCKS[MAX_LOCKED_FDS];
  */
 const char *TEMPFILE;
 
-/* Return the position of the given fd in LOCKS or a position for the
- * invalid fd ( -1 ) if there is no such position
- * We are sure it exists because there can only be one locked file
- * and LOCKS has a size of 2.
+/* Return the position of the given fd in LOCKS, or -1
  */
 static int
 locate_lock (int searchedfd)
 {
-  int invalidfd_pos = -1;
+  assert (searchedfd >= 0);
   for (int i = 0; i < MAX_LOCKED_FDS; i++)
-    if (LOCKS[i].fd == searchedfd)
+    if (__atomic_load_n (&LOCKS[i].fd, __ATOMIC_ACQUIRE) == searchedfd)
       return i;
-    else if (LOCKS[i].fd == -1)
-      invalidfd_pos = i;
-  assert (invalidfd_pos >= 0);
-  return invalidfd_pos;
+  return -1;
 }
 
 /* Called when a lease is being cancelled
@@ -85,8 +95,9 @@ handle_broken_locks (int sig, siginfo_t * info, void *ignored)
   assert (SIGLOCKEXPIRED == sig), assert (ignored);
   int fd = info->si_fd;
   int pos = locate_lock (fd);
-  assert (LOCKS[pos].fd != -1);
-  if (LOCKS[pos].write)
+  if (pos < 0)
+    return;                     // unlocked meanwhile
+  if (__atomic_load_n (&LOCKS[pos].write, __ATOMIC_ACQUIRE))
     error (0, 0,
            "%s: Another program is trying to access the file; "
            "if shaking takes more than lease-break-time seconds "
@@ -94,9 +105,11 @@ handle_broken_locks (int sig, siginfo_t * info, void *ignored)
            "available in '%s'", LOCKS[pos].filename, TEMPFILE);
   else
     {
-      // Cancel this lock
-      LOCKS[pos].fd = -1;
-      error (0, 0, "%s: concurent accesses", LOCKS[pos].filename);
+      const char *filename = LOCKS[pos].filename;
+      // Cancel this lock, unless its owner did meanwhile
+      if (__atomic_compare_exchange_n (&LOCKS[pos].fd, &fd, -1, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        error (0, 0, "%s: concurent accesses", filename);
     }
 }
 
@@ -109,6 +122,7 @@ os_specific_setup (const char *tempfile)
     LOCKS[i].fd = -1;
   /* Setup SIGLOCKEXPIRED handler */
   struct sigaction sa;
+  sigemptyset (&sa.sa_mask);
   sa.sa_flags = SA_SIGINFO;
   sa.sa_sigaction = handle_broken_locks;
   return sigaction (SIGLOCKEXPIRED, &sa, NULL);
@@ -117,19 +131,32 @@ os_specific_setup (const char *tempfile)
 int
 readlock_file (int fd, const char *filename)
 {
-  int pos = locate_lock (fd);
-  assert (LOCKS[pos].fd == -1);
+  assert (-1 == locate_lock (fd));
+  int pos;
+  /*  Register the lock in LOCKS first, so that the handler finds it
+   * even if the lease is broken as soon as it is set
+   */
+  for (pos = 0; pos < MAX_LOCKED_FDS; pos++)
+    {
+      int expected = -1;
+      if (__atomic_compare_exchange_n (&LOCKS[pos].fd, &expected, -2, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        break;
+    }
+  assert (pos < MAX_LOCKED_FDS);
+  LOCKS[pos].filename = filename;
+  __atomic_store_n (&LOCKS[pos].write, false, __ATOMIC_RELAXED);
+  __atomic_store_n (&LOCKS[pos].fd, fd, __ATOMIC_RELEASE);
   // Technically all our locks are write leases
-  if (fcntl (fd, F_SETLEASE, F_WRLCK) != 0)
-    return -1;
-  if (fcntl (fd, F_SETSIG, SIGLOCKEXPIRED) != 0)
-    return -1;
-  /* Register the lock in LOCKS */
-  {
-    LOCKS[pos].filename = filename;
-    LOCKS[pos].fd = fd;
-    LOCKS[pos].write = false;
-  }
+  if (fcntl (fd, F_SETSIG, SIGLOCKEXPIRED) != 0
+      || fcntl (fd, F_SETLEASE, F_WRLCK) != 0)
+    {
+      int errsv = errno;
+      __atomic_compare_exchange_n (&LOCKS[pos].fd, &fd, -1, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+      errno = errsv;
+      return -1;
+    }
   return 0;
 }
 
@@ -137,9 +164,12 @@ int
 readlock_to_writelock (int fd)
 {
   int pos = locate_lock (fd);
-  if (0 > LOCKS[pos].fd)
+  if (0 > pos)
     return -1;                  // The lock has been canceled
-  LOCKS[pos].write = true;
+  __atomic_store_n (&LOCKS[pos].write, true, __ATOMIC_RELEASE);
+  /* The handler may have canceled it just before */
+  if (__atomic_load_n (&LOCKS[pos].fd, __ATOMIC_ACQUIRE) != fd)
+    return -1;
   return 0;
 }
 
@@ -147,9 +177,11 @@ int
 unlock_file (int fd)
 {
   int pos = locate_lock (fd);
-  if (0 > LOCKS[pos].fd)
+  if (0 > pos)
     return -1;
-  LOCKS[pos].fd = -1;
+  if (!__atomic_compare_exchange_n (&LOCKS[pos].fd, &fd, -1, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return -1;                  // Canceled by the handler meanwhile
   // TODO(unbrice): This line is so as to help debugging unlock_file()
   // remove it in a few months.
   errno = 0;
@@ -159,7 +191,303 @@ unlock_file (int fd)
 bool
 is_locked (int fd)
 {
-  return LOCKS[locate_lock (fd)].fd >= 0;
+  return locate_lock (fd) >= 0;
+}
+
+int
+clone_file (int dest_fd, int src_fd)
+{
+#ifdef FICLONE
+  // FICLONE would keep the end of dest_fd if it was longer
+  if (-1 == ftruncate (dest_fd, (off_t) 0))
+    return -1;
+  return ioctl (dest_fd, FICLONE, src_fd);
+#else
+  errno = EOPNOTSUPP;
+  return -1;
+#endif
+}
+
+ssize_t
+read_dir_entries (int fd, void *buff, size_t size)
+{
+  assert (fd > -1 && buff);
+  // glibc only has a wrapper since 2.30
+  return syscall (SYS_getdents64, fd, buff, size);
+}
+
+long
+get_fs_type (int fd)
+{
+  struct statfs sfs;
+  if (-1 == fstatfs (fd, &sfs))
+    return -1;
+  return (long) sfs.f_type;
+}
+
+/*  Like mkstemp() relative to dirfd: creates a file with a random name
+ * in dir, trying other names while they exist, then unlinks it.
+ */
+static int
+open_unlinked (int dirfd, const char *dir)
+{
+  static const char chars[] =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  const uint base = sizeof (chars) - 1;
+  int fd = -1;
+  errno = EEXIST;
+  for (uint tries = 0; -1 == fd && EEXIST == errno && tries < 100; tries++)
+    {
+      struct timespec ts;
+      unsigned long long r;
+      char suffix[7], *name;
+      clock_gettime (CLOCK_REALTIME, &ts);
+      r = ((unsigned long long) ts.tv_nsec << 20)
+        ^ (unsigned long long) ts.tv_sec
+        ^ ((unsigned long long) getpid () << 44)
+        ^ (tries * 0x9e3779b97f4a7c15ULL);
+      for (uint i = 0; i < sizeof (suffix) - 1; i++, r /= base)
+        suffix[i] = chars[r % base];
+      suffix[sizeof (suffix) - 1] = '\0';
+      if (-1 == asprintf (&name, "%s/.shake-donor-%s", dir, suffix))
+        return -1;
+      fd = openat (dirfd, name, O_CREAT | O_EXCL | O_RDWR, 0600);
+      if (-1 != fd)
+        unlinkat (dirfd, name, 0);
+      free (name);
+    }
+  return fd;
+}
+
+int
+open_donor (int dirfd, const char *filename)
+{
+  assert (filename);
+  char *copy = strdup (filename);
+  const char *dir;
+  int fd;
+  if (!copy)
+    return -1;
+  // dirname() may return a static "." instead of changing copy
+  dir = dirname (copy);
+  // O_EXCL: the donor can never be linked in the tree
+  fd = openat (dirfd, dir, O_TMPFILE | O_EXCL | O_RDWR, 0600);
+  // Old kernels and some filesystems don't know O_TMPFILE
+  if (-1 == fd && (EISDIR == errno || EOPNOTSUPP == errno))
+    fd = open_unlinked (dirfd, dir);
+  free (copy);
+  return fd;
+}
+
+/* Defined in the ext4 sources but not exported to userspace
+ */
+#ifndef EXT4_IOC_MOVE_EXT
+struct move_extent
+{
+  __u32 reserved;               // should be zero
+  __u32 donor_fd;
+  __u64 orig_start;             // in blocks
+  __u64 donor_start;            // in blocks
+  __u64 len;                    // in blocks
+  __u64 moved_len;              // in blocks, set by the kernel
+};
+# define EXT4_IOC_MOVE_EXT _IOWR ('f', 15, struct move_extent)
+#endif
+
+int
+move_extents (int fd, int donor_fd, llint start, llint count, llint *moved)
+{
+  assert (fd > -1 && donor_fd > -1);
+  assert (start >= 0 && count > 0 && moved);
+  struct move_extent me;
+  int res;
+  memset (&me, 0, sizeof (me));
+  me.donor_fd = (__u32) donor_fd;
+  me.orig_start = (__u64) start;
+  me.donor_start = (__u64) start;
+  me.len = (__u64) count;
+  res = ioctl (fd, EXT4_IOC_MOVE_EXT, &me);
+  *moved = (llint) me.moved_len;
+  return res;
+}
+
+int
+defrag_file (int fd, llint start, llint len, uint extent_thresh)
+{
+  assert (fd > -1);
+#ifdef BTRFS_IOC_DEFRAG_RANGE
+  struct btrfs_ioctl_defrag_range_args args;
+  memset (&args, 0, sizeof (args));
+  args.start = (__u64) start;
+  args.len = (__u64) len;
+  args.flags = BTRFS_DEFRAG_RANGE_START_IO;
+  args.extent_thresh = (__u32) extent_thresh;
+  return ioctl (fd, BTRFS_IOC_DEFRAG_RANGE, &args);
+#else
+  errno = EOPNOTSUPP;
+  return -1;
+#endif
+}
+
+int
+set_idle_io_priority (void)
+{
+#ifdef SYS_ioprio_set
+  /* From linux/ioprio.h, that glibc doesn't wrap */
+  const int who_process = 1, class_idle = 3, class_shift = 13;
+  return (int) syscall (SYS_ioprio_set, who_process, 0,
+                        class_idle << class_shift);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int
+read_disk_stats (dev_t dev, struct disk_stats *ds)
+{
+  assert (ds);
+  FILE *f = fopen ("/proc/diskstats", "r");
+  char line[256];
+  int res = -1;
+  if (!f)
+    return -1;
+  errno = ENODEV;
+  while (-1 == res && fgets (line, sizeof (line), f))
+    {
+      uint maj, min;
+      llint reads, rticks, writes, wticks;
+      /* major minor name reads merged sectors ms writes merged sectors
+       * ms in_progress ...
+       */
+      if (7 == sscanf (line, "%u %u %*s %lli %*s %*s %lli %lli %*s %*s "
+                       "%lli %lli", &maj, &min, &reads, &rticks,
+                       &writes, &wticks, &ds->inflight)
+          && maj == major (dev) && min == minor (dev))
+        {
+          ds->ios = reads + writes;
+          ds->ticks = rticks + wticks;
+          res = 0;
+        }
+    }
+  fclose (f);
+  return res;
+}
+
+int
+open_busy_time (dev_t dev)
+{
+  char path[PATH_MAX], *real;
+  snprintf (path, sizeof (path), "/sys/dev/block/%u:%u", major (dev),
+            minor (dev));
+  real = realpath (path, NULL);
+  if (!real)
+    return -1;
+  snprintf (path, sizeof (path), "%s/partition", real);
+  if (0 == access (path, F_OK))
+    snprintf (path, sizeof (path), "%s/../stat", real);
+  else
+    snprintf (path, sizeof (path), "%s/stat", real);
+  free (real);
+  return open (path, O_RDONLY);
+}
+
+int
+read_busy_time (int fd, llint *busy)
+{
+  assert (fd >= 0 && busy);
+  char line[256];
+  ssize_t len = pread (fd, line, sizeof (line) - 1, 0);
+  if (len <= 0)
+    return -1;
+  line[len] = '\0';
+  /* reads merged sectors ms writes merged sectors ms in_flight io_ticks */
+  if (1 != sscanf (line, "%*s %*s %*s %*s %*s %*s %*s %*s %*s %lli", busy))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  return 0;
+}
+
+int
+read_io_pressure (llint *total)
+{
+  assert (total);
+  FILE *f = fopen ("/proc/pressure/io", "r");
+  int res = -1;
+  if (!f)
+    return -1;
+  if (1 == fscanf (f, "some avg10=%*f avg60=%*f avg300=%*f total=%lli",
+                   total))
+    res = 0;
+  else
+    errno = EINVAL;
+  fclose (f);
+  return res;
+}
+
+struct xfs_stamp
+{
+#ifdef HAVE_XFS_H
+  struct xfs_bstat bstat;       // includes the ctime and mtime
+#else
+  int unused;
+#endif
+};
+
+struct xfs_stamp *
+get_xfs_stamp (int fd)
+{
+  assert (fd > -1);
+#ifdef HAVE_XFS_H
+  struct xfs_stamp *stamp;
+  struct xfs_fsop_bulkreq req;
+  struct stat st;
+  __u64 ino;
+  __s32 count = 0;
+  if (-1 == fstat (fd, &st))
+    return NULL;
+  stamp = malloc (sizeof (*stamp));
+  if (NULL == stamp)
+    return NULL;
+  ino = (__u64) st.st_ino;
+  req.lastip = &ino;
+  req.icount = 1;
+  req.ubuffer = &stamp->bstat;
+  req.ocount = &count;
+  if (-1 == ioctl (fd, XFS_IOC_FSBULKSTAT_SINGLE, &req))
+    {
+      int errsv = errno;
+      free (stamp);
+      errno = errsv;
+      return NULL;
+    }
+  return stamp;
+#else
+  errno = EOPNOTSUPP;
+  return NULL;
+#endif
+}
+
+int
+swap_extents (int fd, int donor_fd, struct xfs_stamp *stamp)
+{
+  assert (fd > -1 && donor_fd > -1 && stamp);
+#ifdef HAVE_XFS_H
+  struct xfs_swapext sx;
+  memset (&sx, 0, sizeof (sx));
+  sx.sx_version = XFS_SX_VERSION;
+  sx.sx_fdtarget = fd;
+  sx.sx_fdtmp = donor_fd;
+  sx.sx_offset = 0;
+  sx.sx_length = stamp->bstat.bs_size;
+  sx.sx_stat = stamp->bstat;
+  return ioctl (fd, XFS_IOC_SWAPEXT, &sx);
+#else
+  errno = EOPNOTSUPP;
+  return -1;
+#endif
 }
 
 /*  could make an estimation of the required size, but should'nt because attr_setf
@@ -172,7 +500,7 @@ set_ptime (int fd)
 {
   assert (fd > -1);
   uint32_t date = htonl ((uint32_t) time (NULL));
-  return fsetxattr (fd, "shake.ptime", (void *) &date, DATE_SIZE, 0);
+  return fsetxattr (fd, PTIME_XATTR, (void *) &date, DATE_SIZE, 0);
 }
 
 time_t
@@ -180,121 +508,254 @@ get_ptime (int fd)
 {
   assert (fd > -1);
   uint32_t date;
-  int size = DATE_SIZE;
-  if (-1 ==
-      fgetxattr (fd, "shake.ptime", (void *) &date, size))
+  return parse_ptime (&date, fgetxattr (fd, PTIME_XATTR, (void *) &date,
+                                        DATE_SIZE));
+}
+
+time_t
+parse_ptime (const void *value, ssize_t len)
+{
+  uint32_t date;
+  if ((ssize_t) DATE_SIZE != len)
     return (time_t) - 1;
+  memcpy (&date, value, DATE_SIZE);
   date = ntohl (date);
   if (date > time (NULL))
     return (time_t) - 1;
   return (time_t) date;
 }
 
+/* The state of get_testimony(), shared by its FIEMAP and FIBMAP
+ * engines.
+ */
+struct testimony
+{
+  struct accused *a;
+  uint physbsize;
+  llint crumbsize;
+  llint physpos;                // Physical position of the last block, 0 if hole
+  llint fragsize;               // Size of the current fragment
+  bool log;                     // Fill a->fraglog
+};
+
+/* Records a run of len bytes that are physically contiguous and start
+ * at physpos (0 if the run is a hole).
+ *  We detect start and end of fragments by checking if the physical
+ * position of a run is not adjacent to the last block of the previous
+ * one, exactly as if we were looking at blocks one by one.
+ */
+static void
+witness (struct testimony *t, llint physpos, llint len)
+{
+  const uint BUFFSTEP = 32;
+  struct accused *a = t->a;
+  assert (len > 0);
+  /* physpos == 0 if sparse file */
+  if (physpos)
+    {
+      llint lastpos = physpos + len - t->physbsize;     // Pos of the last block
+      if (lastpos < physpos)
+        lastpos = physpos;
+      if (!a->start)
+        a->start = physpos;
+      a->end = lastpos;
+      /* Check if we have a new fragment, */
+      if (llabs (physpos - t->physpos) > MAGICLEAP)
+        {
+          /* log it */
+          if (t->log)
+            {
+              /* Enlarge the log, it is kept when a is reused */
+              if (a->fraglogc == a->fraglogsize)
+                {
+                  uint nsize = a->fraglogsize * 2 + BUFFSTEP;
+                  struct fragment *nlog =
+                    realloc (a->fraglog, nsize * sizeof (*nlog));
+                  if (!nlog)
+                    error (1, errno, "%s: malloc() failed", accused_name (a));
+                  a->fraglog = nlog;
+                  a->fraglogsize = nsize;
+                }
+              /* Record the size of the old frag */
+              if (a->fraglogc)
+                a->fraglog[a->fraglogc - 1].size = t->fragsize;
+              /* Record the pos of the new frag */
+              a->fraglog[a->fraglogc].pos = physpos;
+              a->fraglog[a->fraglogc].size = 0;
+              a->fraglogc++;
+            }
+          if (t->fragsize && t->fragsize < t->crumbsize)
+            a->crumbc++;
+          a->fragc++;
+          t->fragsize = 0;
+        }
+      t->physpos = lastpos;
+    }
+  else
+    t->physpos = 0;
+  t->fragsize += len;
+}
+
+/* Number of extents asked to the kernel by each FIEMAP call */
+#define FIEMAP_BATCH 256
+
+/* Feeds witness() with the extents of the first length bytes of the
+ * file, as returned by FIEMAP. This needs a few ioctl() per file
+ * instead of one per block, and works without being root.
+ * Returns -1 and sets errno if the first call failed, -2 if another
+ * one failed, else 0.
+ */
+static int
+get_testimony_fiemap (struct testimony *t, llint length)
+{
+  /* Extents whose physical position is meaningless are seen as holes,
+   * that is what FIBMAP does
+   */
+  const uint NOPOS = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC
+    | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED;
+  char buff[sizeof (struct fiemap)
+            + FIEMAP_BATCH * sizeof (struct fiemap_extent)];
+  struct fiemap *fm = (struct fiemap *) buff;
+  llint logpos = 0;             // Logical position in the file
+  bool last = false;
+  for (bool first = true; !last && logpos < length; first = false)
+    {
+      memset (fm, 0, sizeof (*fm));
+      fm->fm_start = (__u64) logpos;
+      fm->fm_length = (__u64) (length - logpos);
+      // Like FIBMAP, flush delayed allocations, but only once
+      fm->fm_flags = first ? FIEMAP_FLAG_SYNC : 0;
+      fm->fm_extent_count = FIEMAP_BATCH;
+      if (-1 == ioctl (t->a->fd, FS_IOC_FIEMAP, fm))
+        return first ? -1 : -2;
+      if (0 == fm->fm_mapped_extents)
+        break;
+      for (uint i = 0; i < fm->fm_mapped_extents; i++)
+        {
+          struct fiemap_extent *fe = &fm->fm_extents[i];
+          llint start = (llint) fe->fe_logical;
+          llint stop = (llint) (fe->fe_logical + fe->fe_length);
+          if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+            last = true;
+          if (fe->fe_flags & FIEMAP_EXTENT_SHARED)
+            t->a->sharedc++;
+          if (start < logpos)
+            start = logpos;
+          if (stop > length)
+            stop = length;
+          if (start >= stop)
+            continue;
+          if (start > logpos)
+            witness (t, 0, start - logpos);     // A hole
+          if (fe->fe_flags & NOPOS)
+            witness (t, 0, stop - start);
+          else
+            witness (t, (llint) fe->fe_physical
+                     + (start - (llint) fe->fe_logical), stop - start);
+          logpos = stop;
+        }
+    }
+  /* Trailing hole */
+  if (logpos < length)
+    witness (t, 0, length - logpos);
+  return 0;
+}
+
+/* Feeds witness() with the position of the first blocks blocks of the
+ * file, as returned by FIBMAP. It is used for filesystems that does
+ * not support FIEMAP.
+ *  Please refer to comp.os.linux.development.system for information about
+ * FIBMAP (or ask me but I don't know anything which is not in this file).
+ */
+static int
+get_testimony_fibmap (struct testimony *t, long blocks)
+{
+  for (int i = 0; i < blocks; i++)
+    {
+      int block = i;
+      llint physpos;
+      if (INT_MAX == i)
+        break;                  // The file is too large for FIBMAP
+      /* Query the physical pos of the i-nth block */
+      if (-1 == ioctl (t->a->fd, FIBMAP, &block))
+        {
+          error (0, errno, "%s: FIBMAP failed", accused_name (t->a));
+          return -1;
+        }
+      physpos = (llint) block * t->physbsize;
+      /* workaround reiser4 bug fixed 2006-08-27, TODO : remove */
+      if (physpos < 0)
+        {
+          error (0, 0, "ReiserFS4 bug : UPDATE to at least 2006-08-27");
+          physpos = 0;
+        }
+      witness (t, physpos, t->physbsize);
+    }
+  return 0;
+}
+
+llint
+get_first_block (int fd)
+{
+  assert (fd > -1);
+  char buff[sizeof (struct fiemap) + sizeof (struct fiemap_extent)];
+  struct fiemap *fm = (struct fiemap *) buff;
+  int block = 0;
+  int physbsize;
+  memset (fm, 0, sizeof (*fm));
+  fm->fm_length = FIEMAP_MAX_OFFSET;
+  fm->fm_extent_count = 1;
+  if (0 == ioctl (fd, FS_IOC_FIEMAP, fm))
+    {
+      if (0 == fm->fm_mapped_extents
+          || fm->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN
+                                            | FIEMAP_EXTENT_DELALLOC))
+        return -1;
+      return (llint) fm->fm_extents[0].fe_physical;
+    }
+  /* FIBMAP only sees the first block, even if it is a hole */
+  if (-1 == ioctl (fd, FIGETBSZ, &physbsize)
+      || -1 == ioctl (fd, FIBMAP, &block) || 0 == block)
+    return -1;
+  return (llint) block * physbsize;
+}
+
 int
 get_testimony (struct accused *a, struct law *l)
 {
-  const size_t BUFFSTEP = 32;
-  /* General stats */
-  uint physbsize;
-  int crumbsize;
-  /* Framents logs */
-  llint *sizelog = NULL, *poslog = NULL;        // Framgents sizes and positions
-  unsigned int logs_pos = 0;    // Position in logs
+  struct testimony t = {
+    .a = a,
+    .log = l->verbosity >= 3,
+  };
   /* Convert sizes in number of physical blocks */
   {
-    if (-1 == ioctl (a->fd, FIGETBSZ, &physbsize))
+    if (-1 == ioctl (a->fd, FIGETBSZ, &t.physbsize))
       {
-        error (0, errno, "%s: FIGETBSZ() failed", a->name);
+        error (0, errno, "%s: FIGETBSZ() failed", accused_name (a));
         return -1;
       }
-    a->blocks = (a->size + physbsize - 1) / physbsize;
-    crumbsize = (int) ((double) a->size * l->crumbratio);
+    a->blocks = (a->size + t.physbsize - 1) / t.physbsize;
+    t.crumbsize = (llint) ((double) a->size * l->crumbratio);
   }
-  /* Create the log of fragment, terminated by <-1,-1> */
-  if (l->verbosity >= 3)
-    {
-      sizelog = malloc (BUFFSTEP * sizeof (*sizelog));
-      poslog = malloc (BUFFSTEP * sizeof (*poslog));
-      if (!sizelog || !poslog)
-        error (1, errno, "%s: malloc() failed", a->name);
-      sizelog[logs_pos] = -1;
-      poslog[logs_pos] = -1;
-    }
-  /*  FIBMAP return physical block's position. We use it to detect start and end
-   * of fragments, by checking if the physical position of a block is not
-   * adjacent to the previous one.
-   *  Please refer to comp.os.linux.development.system for information about
-   * FIBMAP (or ask me but I don't know anything which is not in this file).
-   */
+  a->fraglogc = 0;
+  /* Prefer FIEMAP, fall back on FIBMAP if the FS doesn't support it */
   {
-    llint physpos = 0, prevphyspos = 0;
-    uint fragsize = 0;
-    for (int i = 0; i < a->blocks; i++)
-      {
-        if (INT_MAX == i)
-          break;                // The file is too large for FIBMAP
-        /* Query the physical pos of the i-nth block */
-        prevphyspos = physpos;
-        physpos = i;
-        if (-1 == ioctl (a->fd, FIBMAP, &physpos))
-          {
-            error (0, errno, "%s: FIBMAP failed", a->name);
-            return -1;
-          }
-        physpos = physpos * physbsize;
-        /* workaround reiser4 bug fixed 2006-08-27, TODO : remove */
-        if (physpos < 0)
-          {
-            error (0, 0, "ReiserFS4 bug : UPDATE to at least 2006-08-27");
-            physpos = 0;
-          }
-        /* physpos == 0 if sparse file */
-        if (physpos)
-          {
-            if (!a->start)
-              a->start = physpos;
-            a->end = physpos;
-            /* Check if we have a new fragment, */
-            if (llabs (physpos - prevphyspos) > MAGICLEAP)
-              {
-                /* log it */
-                if (l->verbosity >= 3)
-                  {
-                    /* Periodically enlarge the log */
-                    if (0 == (logs_pos + 2) % BUFFSTEP)
-                      {
-                        size_t nsize =
-                          (logs_pos + 2 + BUFFSTEP) * sizeof (*sizelog);
-                        sizelog = realloc (sizelog, nsize);
-                        poslog = realloc (poslog, nsize);
-                        if (!sizelog || !poslog)
-                          error (1, errno, "%s: malloc() failed", a->name);
-                      }
-                    /* Record the pos of the new frag */
-                    poslog[logs_pos] = physpos;
-                    /* Record the size of the old frag */
-                    if (logs_pos)
-                      sizelog[logs_pos - 1] = fragsize;
-                    logs_pos++;
-                  }
-                if (fragsize && fragsize < crumbsize)
-                  a->crumbc++;
-                a->fragc++;
-                fragsize = 0;
-              }
-          }
-        fragsize += physbsize;
-      }
-    /* Record the last size, and close the log */
-    if (l->verbosity >= 3 && fragsize)
+    int res = get_testimony_fiemap (&t, (llint) a->blocks * t.physbsize);
+    if (-1 == res && (EOPNOTSUPP == errno || ENOTTY == errno
+                      || EINVAL == errno || EBADR == errno))
+      res = get_testimony_fibmap (&t, a->blocks);
+    else if (0 > res)
+      error (0, errno, "%s: FIEMAP failed", accused_name (a));
+    if (0 > res)
       {
-        if (logs_pos)
-          sizelog[logs_pos - 1] = fragsize;
-        poslog[logs_pos] = -1;
-        sizelog[logs_pos] = -1;
-        a->poslog = poslog;
-        a->sizelog = sizelog;
+        a->fraglogc = 0;
+        return -1;
       }
   }
+  /* Record the last size */
+  if (!t.fragsize)
+    a->fraglogc = 0;
+  else if (a->fraglogc)
+    a->fraglog[a->fraglogc - 1].size = t.fragsize;
   return 0;
 }
@@ -25,10 +25,15 @@
 # include <stdbool.h>		// bool
 # include <stdio.h>		// getline, asprintf
 # include <sys/time.h>		// struct timeval
+# include <sys/types.h>		// ssize_t
 # include "judge.h"
 
 # define OS_RESERVED_SIGNAL 16
 
+/* The xattr holding the ptime, see get_ptime()
+ */
+# define PTIME_XATTR "shake.ptime"
+
 /* Called once, perform OS-specific tasks.
  */
 int os_specific_setup (const char *tempfile);
@@ -57,6 +62,105 @@ bool is_locked (int fd);
 
 
 
+/* Makes dest_fd an instant copy of src_fd, sharing its extents.
+ * Return -1 and set errno (EOPNOTSUPP, EXDEV...) if the filesystem
+ * can't do it.
+ */
+int clone_file (int dest_fd, int src_fd);
+
+/* Fill buff with as many struct dirent64 of the directory fd as it can
+ * hold, with their d_ino and d_type. This is getdents64().
+ * Return the number of bytes read, 0 at the end of the directory,
+ * -1 and set errno if failed.
+ */
+ssize_t read_dir_entries (int fd, void *buff, size_t size);
+
+/* Return the f_type of the filesystem holding fd, as in linux/magic.h,
+ * or -1 and set errno.
+ */
+long get_fs_type (int fd);
+
+/* Return an unnamed file, opened read-write, in the directory of
+ * filename relative to dirfd, so that it is on the same filesystem.
+ * It vanishes when closed.
+ * Return -1 and set errno if failed.
+ */
+int open_donor (int dirfd, const char *filename);
+
+/* Ask ext4 to exchange count blocks of fd, from block start, with the
+ * same blocks of donor_fd. Blocks are moved by the kernel, so fd stays
+ * coherent even if it is accessed meanwhile.
+ * Sets *moved to the number of blocks moved, holes are not counted.
+ * Return -1 and set errno if failed.
+ */
+int move_extents (int fd, int donor_fd, llint start, llint count,
+                  llint *moved);
+
+/* Ask btrfs to rewrite the extents of fd that are smaller than
+ * extent_thresh bytes, between start and start + len, and to start
+ * writing them.
+ * Return -1 and set errno if failed.
+ */
+int defrag_file (int fd, llint start, llint len, uint extent_thresh);
+
+/* Cumulative counters of a block device, from /proc/diskstats
+ */
+struct disk_stats
+{
+  llint ios;			// reads and writes completed
+  llint ticks;			// ms spent by them
+  llint inflight;		// requests in progress now
+};
+
+/* Fill ds for the block device dev.
+ * Return -1 and set errno if failed, eg. if the filesystem of dev has
+ * no block device of its own (btrfs, NFS...).
+ */
+int read_disk_stats (dev_t dev, struct disk_stats *ds);
+
+/* Open the sysfs stat file of the disk that holds the block device dev:
+ * the whole disk for a partition, as its neighbours share the disk.
+ * Return -1 and set errno if failed, eg. if dev isn't a block device.
+ */
+int open_busy_time (dev_t dev);
+
+/* Put in busy the milliseconds during which the disk of fd, opened by
+ * open_busy_time(), had requests in progress since boot.
+ * Return -1 and set errno if failed.
+ */
+int read_busy_time (int fd, llint *busy);
+
+/* Put in total the microseconds during which some tasks were stalled
+ * on I/O since boot, from /proc/pressure/io.
+ * Return -1 and set errno if failed, eg. without CONFIG_PSI.
+ */
+int read_io_pressure (llint *total);
+
+/* Put the process in the idle I/O class, so that the disk serves it
+ * only when nobody else needs it. Threads started later inherit it.
+ * Return -1 and set errno if failed.
+ */
+int set_idle_io_priority (void);
+
+/* What XFS needs to know if a file changed, see swap_extents()
+ */
+struct xfs_stamp;
+
+/* Return a stamp of fd, to be free()d.
+ * Return NULL and set errno if failed, to EOPNOTSUPP if shake was built
+ * without XFS headers.
+ */
+struct xfs_stamp *get_xfs_stamp (int fd);
+
+/* Ask XFS to exchange the extents of fd with the ones of donor_fd, which
+ * must have the same size. It fails with EBUSY if fd has changed since
+ * stamp was taken.
+ * Return -1 and set errno if failed.
+ */
+int swap_extents (int fd, int donor_fd, struct xfs_stamp *stamp);
+
+
+
 /* Declares the glibc function
  */
 int futimes (int fd, const struct timeval tv[2]);
@@ -69,11 +173,22 @@ int set_ptime (int fd);
  */
 time_t get_ptime (int fd);
 
+/*  Decode the len bytes read from PTIME_XATTR, as get_ptime() does.
+ * len can be -1 if reading it failed.
+ */
+time_t parse_ptime (const void *value, ssize_t len);
+
 /*  This function is mainly a wrapper around ioctl()s.
  *  It updates a->{blocks, crumbc, fragc, start and end}
  * with just a bit of undocumented black magic.
+ *  It uses FIEMAP, or FIBMAP on filesystems that does not support it.
  *  It can only be called after investigate().
  */
 int get_testimony (struct accused *a, struct law *l);
 
+/* Return the physical position of the first data of fd, in bytes,
+ * or -1 if it is unknown (empty or not yet allocated file...).
+ */
+llint get_first_block (int fd);
+
 #endif
@@ -61,20 +61,27 @@
  *
  ***************************************************************/
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
 #include <error.h>
 #include <string.h>
+#include <stdio.h>		// setvbuf()
 
 #include <unistd.h>		// unlink()
+#include <fcntl.h>		// AT_FDCWD
 #include <sys/types.h>		// umask()
 #include <sys/stat.h>		// umask()
+#include <time.h>		// strptime(), mktime()
 #include "linux.h"
 #include "judge.h"
 #include "executive.h"
 #include "msg.h"
 #include "signals.h"
+#include "throttle.h"
+#include "walker.h"
+#include "watch.h"
 
 
 
@@ -110,6 +117,37 @@ argtof (char *str, int min, char *name)
   return res;
 }
 
+/*  Read the string at str, a time of the day as HH:MM or a number of
+ * minutes from now. If it is neither, exit with an error. Else return
+ * the next time it designates.
+ */
+static time_t
+argtodeadline (char *str, char *name)
+{
+  time_t now = time (NULL);
+  struct tm tm;
+  char *endptr;
+  long minutes;
+  assert (str && name);
+  if (strchr (str, ':'))
+    {
+      localtime_r (&now, &tm);
+      endptr = strptime (str, "%H:%M", &tm);
+      if (!endptr || *endptr)
+	error (1, 0, "%s must be HH:MM or a number of minutes", name);
+      tm.tm_sec = 0;
+      tm.tm_isdst = -1;
+      /* Tomorrow if the time is already past today */
+      if (mktime (&tm) <= now)
+	tm.tm_mday++;
+      return mktime (&tm);
+    }
+  minutes = strtol (str, &endptr, 10);
+  if (str == endptr || *endptr || minutes < 0)
+    error (1, 0, "%s must be HH:MM or a number of minutes", name);
+  return now + 60 * minutes;
+}
+
 /*  This function takes argc, argv and a law.
  *  It adapt the law to options specified by user, reorder argv to
  * put file names at the end, and return an integer corresponding
@@ -138,6 +176,22 @@ parseopts (int argc, char **restrict argv, struct law *restrict l)
     l->locks = true;
     l->kingdom = 0;		// --many-fs disabled
     l->xattr = 1;
+    l->direct_io = false;
+    l->backend = BACKEND_AUTO;
+    l->order = ORDER_ATIME;
+    l->jobs = 0;
+    l->delim = '\n';
+    l->reorder = 0;
+    l->max_rate = 0;
+    l->max_iops = 0;
+    l->limits_file = NULL;
+    l->idle = false;
+    l->adaptive = false;
+    l->quiet_time = 0;
+    l->ranked = false;
+    l->max_bytes = 0;
+    l->deadline = 0;
+    l->watch = false;
   }
   /* Like the manpage said .. */
   while (1)
@@ -145,32 +199,70 @@ parseopts (int argc, char **restrict argv, struct law *restrict l)
       int c;
       /* Associate long names to short ones */
       static const struct option long_options[] = {
+	{"null", no_argument, NULL, '0'},
+	{"adaptive", no_argument, NULL, 'A'},
+	{"backend", required_argument, NULL, 'b'},
+	{"max-rate", required_argument, NULL, 'B'},
 	{"max-crumbc", required_argument, NULL, 'c'},
 	{"max-fragc", required_argument, NULL, 'C'},
 	{"max-deviance", required_argument, NULL, 'd'},
+	{"direct-io", no_argument, NULL, 'D'},
+	{"deadline", required_argument, NULL, 'E'},
+	{"limits-file", required_argument, NULL, 'F'},
 	{"help", no_argument, NULL, 'h'},
+	{"idle", no_argument, NULL, 'i'},
+	{"max-iops", required_argument, NULL, 'I'},
+	{"jobs", required_argument, NULL, 'j'},
 	{"no-locks", no_argument, NULL, 'L'},
 	{"many-fs", no_argument, NULL, 'm'},
+	{"max-bytes", required_argument, NULL, 'M'},
 	{"new", required_argument, NULL, 'n'},
 	{"old", required_argument, NULL, 'o'},
+	{"order", required_argument, NULL, 'O'},
 	{"pretend", no_argument, NULL, 'p'},
+	{"quiet-time", required_argument, NULL, 'Q'},
 	{"verbose", no_argument, NULL, 'v'},
 	{"crumbratio", required_argument, NULL, 'r'},
+	{"reorder", required_argument, NULL, 'R'},
 	{"smallsize", required_argument, NULL, 's'},
 	{"bigsize", required_argument, NULL, 'S'},
 	{"small-tolerance", required_argument, NULL, 't'},
 	{"big-tolerance", required_argument, NULL, 'T'},
 	{"version", no_argument, NULL, 'V'},
+	{"watch", no_argument, NULL, 'w'},
 	{"no-xattr", no_argument, NULL, 'X'},
 	{0, 0, 0, 0}
       };
       c =
-	getopt_long (argc, argv, "c:C:d:hL:mn:o:pvr:s:S:t:T:VWX",
+	getopt_long (argc, argv, "0Ab:B:c:C:d:DE:F:hiI:j:L:mM:n:o:O:pQ:vr:R:s:S:t:T:VwWX",
 		     long_options, NULL);
       if (c == -1)
 	break;
       switch (c)
 	{
+	case '0':
+	  l->delim = '\0';
+	  break;
+	case 'A':
+	  l->adaptive = true;
+	  break;
+	case 'b':
+	  if (0 == strcmp (optarg, "auto"))
+	    l->backend = BACKEND_AUTO;
+	  else if (0 == strcmp (optarg, "copy"))
+	    l->backend = BACKEND_COPY;
+	  else if (0 == strcmp (optarg, "ext4"))
+	    l->backend = BACKEND_MOVE_EXT;
+	  else if (0 == strcmp (optarg, "xfs"))
+	    l->backend = BACKEND_SWAPEXT;
+	  else if (0 == strcmp (optarg, "btrfs"))
+	    l->backend = BACKEND_DEFRAG;
+	  else
+	    error (1, 0, "unknown backend: %s", optarg);
+	  break;
+	case 'B':
+	  l->max_rate = kB * (llint) argtoi (optarg, 0, "max-rate");
+	  break;
 	case 'c':
 	  l->maxcrumbc = argtoi (optarg, 0, "max-crumbc");
 	  break;
@@ -180,15 +272,40 @@ parseopts (int argc, char **restrict argv, struct law *restrict l)
 	case 'd':
 	  l->maxdeviance = argtoi (optarg, 0, "max-deviance");
 	  break;
+	case 'D':
+	  l->direct_io = true;
+	  break;
+	case 'E':
+	  l->deadline = argtodeadline (optarg, "deadline");
+	  l->ranked = true;
+	  break;
+	case 'F':
+	  l->limits_file = optarg;
+	  break;
 	case 'h':
 	  show_help ();
 	  exit (0);
+	case 'i':
+	  l->idle = true;
+	  break;
+	case 'I':
+	  l->max_iops = argtoi (optarg, 0, "max-iops");
+	  break;
+	case 'j':
+	  l->jobs = argtoi (optarg, 0, "jobs");
+	  if (l->jobs > MAX_JOBS)
+	    error (1, 0, "jobs must be <= %i", MAX_JOBS);
+	  break;
 	case 'L':
 	  l->locks = false;
 	  break;
 	case 'm':
 	  l->kingdom = (dev_t) - 1;	// ignore filesystems
 	  break;
+	case 'M':
+	  l->max_bytes = kB * (llint) argtoi (optarg, 1, "max-bytes");
+	  l->ranked = true;
+	  break;
 	case 'n':
 	  l->new = day * argtoi (optarg, 0, "new");
 	  if (l->new > l->old)
@@ -199,12 +316,32 @@ parseopts (int argc, char **restrict argv, struct law *restrict l)
 	  if (l->old < l->new)
 	    l->new = l->old;
 	  break;
+	case 'O':
+	  if (0 == strcmp (optarg, "atime"))
+	    l->order = ORDER_ATIME;
+	  else if (0 == strcmp (optarg, "name"))
+	    l->order = ORDER_NAME;
+	  else if (0 == strcmp (optarg, "inode"))
+	    l->order = ORDER_INODE;
+	  else if (0 == strcmp (optarg, "physical"))
+	    l->order = ORDER_PHYSICAL;
+	  else if (0 == strcmp (optarg, "none"))
+	    l->order = ORDER_NONE;
+	  else
+	    error (1, 0, "unknown order: %s", optarg);
+	  break;
 	case 'p':
 	  l->pretend = true;
 	  break;
+	case 'Q':
+	  l->quiet_time = argtoi (optarg, 0, "quiet-time");
+	  break;
 	case 'r':
 	  l->crumbratio = argtof (optarg, 0, "crumbratio");
 	  break;
+	case 'R':
+	  l->reorder = argtoi (optarg, 0, "reorder");
+	  break;
 	case 's':
 	  l->smallsize = kB * argtoi (optarg, 0, "small-size");
 	  if (l->smallsize > l->bigsize)
@@ -227,6 +364,9 @@ parseopts (int argc, char **restrict argv, struct law *restrict l)
 	case 'V':
 	  show_version ();
 	  exit (0);
+	case 'w':
+	  l->watch = true;
+	  break;
 	case 'X':
 	  l->xattr = 0;
 	  break;
@@ -236,6 +376,10 @@ parseopts (int argc, char **restrict argv, struct law *restrict l)
 	  error (1, 0, "invalid args, aborting");
 	}
     }
+  if (l->watch && l->ranked)
+    error (1, 0, "--watch can't be used with --max-bytes or --deadline");
+  if (l->watch && optind == argc)
+    error (1, 0, "--watch needs the paths of the mounts to watch");
   return optind;
 }
 
@@ -282,15 +426,30 @@ main (int argc, char **argv)
   }
   install_sighandler (tmpname);
   os_specific_setup (tmpname);
+  if (l.idle && -1 == set_idle_io_priority ())
+    error (0, errno, "failed to use the idle I/O class, continuing without");
+  if (-1 == throttle_setup (l.max_rate, l.max_iops, l.limits_file,
+			    l.adaptive, l.quiet_time))
+    error (1, errno, "%s: can't read the limits", l.limits_file);
+  if (l.jobs && -1 == walker_start (l.jobs, &l))
+    error (0, errno, "failed to start threads, continuing without");
 
+  /* Watch mode logs its verdicts, they must be readable while it runs */
+  if (l.watch)
+    setvbuf (stdout, NULL, _IOLBF, 0);
   /* Do the stuff (tm) */
   show_header (&l);
-  if (optind == argc)
+  if (l.watch)
+    {
+      if (-1 == watch (argv + optind, argc - optind, &l))
+	error (1, errno, "failed to watch the mounts");
+    }
+  else if (optind == argc)
     judge_stdin (NULL, &l);
   else
     for (int i = optind; i != argc; i++)
       {
-	a = investigate (argv[i], &l);
+	a = investigate (AT_FDCWD, NULL, argv[i], &l);
 	if (NULL == a)
 	  continue;		// error have been displayed by investigate()
 	if ((dev_t) - 1 != l.kingdom)	// --one-file-system
@@ -298,6 +457,9 @@ main (int argc, char **argv)
 	judge (a, &l);
 	close_case (a, &l);
       }
+  if (l.ranked)
+    judge_ranked (&l);
+  walker_stop ();
   unlink (tmpname);
   free (tmpname);
   return 0;
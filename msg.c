@@ -21,6 +21,7 @@
 
 #include "config.h"
 #include "msg.h"
+#include "executive.h"	// accused_name()
 
 void
 show_help (void)
@@ -31,22 +32,37 @@ Rewrite fragmented or misplaced files, maybe improving performance.\n\
 Reads file list from standard input if there is no files in the arguments.\n\
 You have to mount your partition with the user_xattr option.\n\
 \n\
+  -0, --null		names read from stdin are separated by NUL, not newline\n\
+  -A, --adaptive	adapt the rate to the I/O pressure, under --max-rate\n\
+  -b, --backend		how to rewrite files: auto, copy, ext4, xfs or btrfs\n\
+  -B, --max-rate	kB per second shake may copy, 0 for no limit\n\
   -c, --max-crumbc	max number of crumbs\n\
   -C, --max-fragc	max number of fragments\n\
   -d, --max-deviance	max distance between file start and it's ideal position\n\
+  -D, --direct-io	bypass the page cache when copying files\n\
+  -E, --deadline	stop shaking at HH:MM or after this many minutes\n\
+  -F, --limits-file	file holding the max rate and iops, read every second\n\
   -h, --help		you're looking at me !\n\
+  -i, --idle		only use the disk when nobody else does\n\
+  -I, --max-iops	read and write operations per second shake may do\n\
+  -j, --jobs		number of threads investigating files in advance\n\
   -L, --no-locks	don't put a lock on written files\n\
   -m, --many-fs		shake subdirectories that are on different filesystems\n\
+  -M, --max-bytes	kB shake may rewrite, the files that gain most first\n\
   -n, --new		age of \"new\" files, which will be shak()ed\n\
   -o, --old		age of \"old\" files, which won't be shak()ed\n\
+  -O, --order		order of files: atime, name, inode, physical or none\n\
   -p, --pretend		don't alter files\n\
+  -Q, --quiet-time	rewrite files only once their disk was idle this many seconds\n\
   -r, --crumbratio	ratio of the file under which a fragment is a crumb\n\
+  -R, --reorder		read, sort and shake lists by batches of this many names\n\
   -s, --smallsize	the size under which a file is considered small\n\
   -S, --bigsize		the size under which a file is considered big\n\
   -t, --small-tolerance	multiply crumbratio and divide maxfnumber of small files\n\
   -T, --big-tolerance	multiply crumbratio and divide maxfnumber of big files\n\
   -v, --verbose		increase the verbosity level\n\
   -V, --version		show version number and copyright\n\
+  -w, --watch		shake the files written on the mounts of FILES, from now on\n\
   -X, --no-xattr	disable usage of xattr\n\
 Report bugs at https://github.com/unbrice/shake/issues\
 ");
@@ -81,15 +97,15 @@ show_reg (struct accused *a, struct law *l)
   /* Show file status */
   printf ("%lli\t%lli\t%lli\t%i\t%i\t%i\t%i\t%s",
 	  a->ideal, a->start / 1024, a->end / 1024, a->fragc, a->crumbc,
-	  (int) (a->age / 3600 / 24), a->guilty, a->name);
+	  (int) (a->age / 3600 / 24), a->guilty, accused_name (a));
   /* And, eventualy, list of frags and crumbs */
-  if (l->verbosity > 2 && a->poslog && a->poslog[0] != -1)
+  if (l->verbosity > 2 && a->fraglogc)
     {
-      uint n;
+      struct fragment *f = a->fraglog;
       putchar ('\t');
-      for (n = 0; a->sizelog[n + 1] != -1; n++)
-	printf ("%lli:%lli,", a->poslog[n] / 1024, a->sizelog[n] / 1024);
-      printf ("%lli:%lli\n", a->poslog[n] / 1024, a->sizelog[n] / 1024);
+      for (uint n = 1; n < a->fraglogc; n++, f++)
+	printf ("%lli:%lli,", f->pos / 1024, f->size / 1024);
+      printf ("%lli:%lli\n", f->pos / 1024, f->size / 1024);
     }
   else
     putchar ('\n');
@@ -0,0 +1,124 @@
+/***************************************************************************/
+/*  Copyright (C) 2026 Brice Arnould.                                      */
+/*                                                                         */
+/*  This file is part of ShaKe.                                            */
+/*                                                                         */
+/*  ShaKe is free software; you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by   */
+/*  the Free Software Foundation; either version 3 of the License, or      */
+/*  (at your option) any later version.                                    */
+/*                                                                         */
+/*  This program is distributed in the hope that it will be useful,        */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of         */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          */
+/*  GNU General Public License for more details.                           */
+/*                                                                         */
+/*  You should have received a copy of the GNU General Public License      */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+/***************************************************************************/
+
+#include "linux.h"              // get_first_block()
+#include "order.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <error.h>              // error()
+#include <fcntl.h>              // openat()
+#include <limits.h>             // LLONG_MAX
+#include <string.h>             // strcmp()
+#include <sys/stat.h>           // fstatat()
+#include <unistd.h>             // close()
+
+/* A name and what it is sorted by
+ */
+struct keyed_name
+{
+  llint key;
+  char *name;
+};
+
+/* Returns the physical position of name, or -1 if unknown.
+ */
+static llint
+get_physical_key (int dirfd, const char *name)
+{
+  llint pos;
+  int fd = openat (dirfd, name, O_RDONLY | O_NOATIME | O_NONBLOCK);
+  // O_NOATIME is only allowed to the owner of the file
+  if (-1 == fd && EPERM == errno)
+    fd = openat (dirfd, name, O_RDONLY | O_NONBLOCK);
+  if (-1 == fd)
+    return -1;
+  pos = get_first_block (fd);
+  close (fd);
+  return pos;
+}
+
+/* Returns the key of name, LLONG_MAX if it can't be collected.
+ * ino is its inode number, 0 if unknown.
+ */
+static llint
+get_key (int dirfd, const char *name, ino_t ino, enum order order)
+{
+  struct stat st;
+  llint pos;
+  if (ORDER_NAME == order)
+    return 0;                   // only ties
+  if (ORDER_INODE == order && ino)
+    return (llint) ino;
+  if (-1 == fstatat (dirfd, name, &st, AT_SYMLINK_NOFOLLOW))
+    return LLONG_MAX;
+  switch (order)
+    {
+    case ORDER_ATIME:
+      return -(llint) st.st_atime;      // most recently used first
+    case ORDER_INODE:
+      return (llint) st.st_ino;
+    case ORDER_PHYSICAL:
+      // Opening anything else could block or have side effects
+      if (!S_ISREG (st.st_mode) && !S_ISDIR (st.st_mode))
+        return LLONG_MAX;
+      pos = get_physical_key (dirfd, name);
+      return -1 == pos ? LLONG_MAX : pos;
+    default:
+      return 0;
+    }
+}
+
+/*  For use by qsort().
+ */
+static int
+compare_keys (const void *a, const void *b)
+{
+  assert (a && b);
+  const struct keyed_name *ka = a;
+  const struct keyed_name *kb = b;
+  if (ka->key != kb->key)
+    return ka->key < kb->key ? -1 : 1;
+  return strcmp (ka->name, kb->name);
+}
+
+void
+sort_list (char **flist, const ino_t * inos, size_t n, int dirfd,
+           enum order order)
+{
+  assert (flist);
+  struct keyed_name *keys;
+  if (ORDER_NONE == order || n < 2)
+    return;
+  keys = malloc (n * sizeof (*keys));
+  if (!keys)
+    {
+      error (0, errno, "malloc() failed, files won't be sorted");
+      return;
+    }
+  for (size_t i = 0; i < n; i++)
+    {
+      keys[i].name = flist[i];
+      keys[i].key = get_key (dirfd, flist[i], inos ? inos[i] : 0, order);
+    }
+  qsort (keys, n, sizeof (*keys), &compare_keys);
+  for (size_t i = 0; i < n; i++)
+    flist[i] = keys[i].name;
+  free (keys);
+}
@@ -0,0 +1,37 @@
+/***************************************************************************/
+/*  Copyright (C) 2026 Brice Arnould.                                      */
+/*                                                                         */
+/*  This file is part of ShaKe.                                            */
+/*                                                                         */
+/*  ShaKe is free software; you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by   */
+/*  the Free Software Foundation; either version 3 of the License, or      */
+/*  (at your option) any later version.                                    */
+/*                                                                         */
+/*  This program is distributed in the hope that it will be useful,        */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of         */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          */
+/*  GNU General Public License for more details.                           */
+/*                                                                         */
+/*  You should have received a copy of the GNU General Public License      */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+/***************************************************************************/
+
+#ifndef ORDER_H
+# define ORDER_H
+# include <stddef.h>
+# include <sys/types.h>
+# include "judge.h"
+
+/*  Sort the n first names of flist according to order.
+ *  The key of each name is collected once, then the keys are sorted,
+ * so that a list of n names costs n lookups instead of O(n log n).
+ * Names whose key can't be collected go last, ties are sorted by name.
+ *  If inos is not NULL, it holds the inode numbers of the names, as
+ * read from the directory, so that ORDER_INODE needs no lookup.
+ *  Names are relative to the directory dirfd, which can be AT_FDCWD.
+ */
+void sort_list (char **flist, const ino_t * inos, size_t n, int dirfd,
+                enum order order);
+
+#endif /* ORDER_H */
@@ -0,0 +1,274 @@
+/***************************************************************************/
+/*  Copyright (C) 2026 Brice Arnould.                                      */
+/*                                                                         */
+/*  This file is part of ShaKe.                                            */
+/*                                                                         */
+/*  ShaKe is free software; you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by   */
+/*  the Free Software Foundation; either version 3 of the License, or      */
+/*  (at your option) any later version.                                    */
+/*                                                                         */
+/*  This program is distributed in the hope that it will be useful,        */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of         */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          */
+/*  GNU General Public License for more details.                           */
+/*                                                                         */
+/*  You should have received a copy of the GNU General Public License      */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+/***************************************************************************/
+
+#include "config.h"
+#include "linux.h"              // PTIME_XATTR, parse_ptime()
+#include "probe.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <error.h>              // error()
+#include <fcntl.h>              // O_NOATIME, AT_SYMLINK_NOFOLLOW
+#include <stdint.h>             // uint32_t
+#include <sys/stat.h>           // struct statx, S_ISREG()
+#include <sys/sysmacros.h>      // makedev()
+#include <unistd.h>             // close()
+#ifdef HAVE_LIBURING
+# include <liburing.h>          // io_uring_*()
+#endif
+
+#ifdef HAVE_LIBURING
+
+/* The ring of the probers, set up by probe_setup() on first use
+ */
+static struct
+{
+  bool ready;                   // true if the ring can be used
+  bool tried;                   // true if probe_setup() has been called
+  bool xattr;                   // false if the kernel can't getxattr
+  struct io_uring ring;
+} PROBE;
+
+struct prober
+{
+  char *restrict * flist;
+  int dirfd;
+  struct law *l;
+  uint base;                    // probes[0] is the one of flist[base]
+  uint count;                   // number of probes in the batch
+  bool probed[PROBE_BATCH];     // false if probes[i] is to be ignored
+  struct probe probes[PROBE_BATCH];
+  struct statx stx[PROBE_BATCH];
+  uint32_t ptimes[PROBE_BATCH]; // raw PTIME_XATTR
+};
+
+/* Prepares the ring. Returns false if it can't be used.
+ */
+static bool
+probe_setup (void)
+{
+  if (PROBE.tried)
+    return PROBE.ready;
+  PROBE.tried = true;
+  PROBE.xattr = true;
+  PROBE.ready = 0 <= io_uring_queue_init (PROBE_BATCH, &PROBE.ring, 0);
+  return PROBE.ready;
+}
+
+/*  Submits the queued requests, then waits for them and stores the
+ * result of each in res[], at the index found in its user_data.
+ *  Returns -1 and gives up the ring if io_uring failed, else 0.
+ */
+static int
+reap_all (uint queued, int *res)
+{
+  int submitted = io_uring_submit_and_wait (&PROBE.ring, queued);
+  for (int i = 0; i < submitted; i++)
+    {
+      struct io_uring_cqe *cqe;
+      if (0 > io_uring_wait_cqe (&PROBE.ring, &cqe))
+        break;
+      res[cqe->user_data] = cqe->res;
+      io_uring_cqe_seen (&PROBE.ring, cqe);
+    }
+  if (submitted != (int) queued)
+    {
+      error (0, 0 > submitted ? -submitted : 0,
+             "io_uring failed, investigating files one by one");
+      io_uring_queue_exit (&PROBE.ring);
+      PROBE.ready = false;
+      return -1;
+    }
+  return 0;
+}
+
+/* Returns a submission entry for probes[i]
+ */
+static struct io_uring_sqe *
+probe_sqe (uint i)
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe (&PROBE.ring);
+  // The ring has PROBE_BATCH entries and is empty between batches
+  assert (sqe);
+  sqe->user_data = (__u64) i;
+  return sqe;
+}
+
+/*  Probe the files of pr->flist from base, replacing the previous batch
+ */
+static void
+probe_batch (struct prober *pr, uint base)
+{
+  int res[PROBE_BATCH];
+  bool opening[PROBE_BATCH];
+  uint queued;
+  for (uint i = 0; i < pr->count; i++)
+    if (-1 != pr->probes[i].fd)
+      close (pr->probes[i].fd);
+  pr->base = base;
+  for (pr->count = 0; pr->count < PROBE_BATCH && pr->flist[base + pr->count];
+       pr->count++)
+    {
+      pr->probed[pr->count] = false;
+      pr->probes[pr->count].fd = -1;
+    }
+  if (!PROBE.ready)
+    return;
+  /* lstat() */
+  for (uint i = 0; i < pr->count; i++)
+    io_uring_prep_statx (probe_sqe (i), pr->dirfd, pr->flist[base + i],
+                         AT_SYMLINK_NOFOLLOW,
+                         STATX_BASIC_STATS, &pr->stx[i]);
+  if (-1 == reap_all (pr->count, res))
+    return;
+  for (uint i = 0; i < pr->count; i++)
+    {
+      struct probe *p = &pr->probes[i];
+      struct statx *stx = &pr->stx[i];
+      p->stat_errno = 0 > res[i] ? -res[i] : 0;
+      p->mode = stx->stx_mode;
+      p->dev = makedev (stx->stx_dev_major, stx->stx_dev_minor);
+      p->ino = (ino_t) stx->stx_ino;
+      p->nlink = (nlink_t) stx->stx_nlink;
+      p->blocks = (blkcnt_t) stx->stx_blocks;
+      p->atime = (time_t) stx->stx_atime.tv_sec;
+      p->mtime = (time_t) stx->stx_mtime.tv_sec;
+      p->ctime = (time_t) stx->stx_ctime.tv_sec;
+      p->open_errno = 0;
+      p->has_ptime = false;
+    }
+  /* open() the files investigate() will open */
+  queued = 0;
+  for (uint i = 0; i < pr->count; i++)
+    {
+      struct probe *p = &pr->probes[i];
+      opening[i] = !p->stat_errno && S_ISREG (p->mode) && 0 != p->blocks
+        && needs_open (p->blocks * 512, p->ctime, pr->l);
+      if (!opening[i])
+        continue;
+      io_uring_prep_openat (probe_sqe (i), pr->dirfd, pr->flist[base + i],
+                            O_NOATIME | O_RDWR, 0);
+      queued++;
+    }
+  if (-1 == reap_all (queued, res))
+    return;
+  for (uint i = 0; i < pr->count; i++)
+    {
+      if (opening[i] && 0 > res[i])
+        pr->probes[i].open_errno = -res[i];
+      else if (opening[i])
+        pr->probes[i].fd = res[i];
+      pr->probed[i] = true;
+    }
+#ifdef HAVE_IO_URING_PREP_FGETXATTR
+  /* getxattr() the ptime of opened files */
+  if (!pr->l->xattr || !PROBE.xattr)
+    return;
+  queued = 0;
+  for (uint i = 0; i < pr->count; i++)
+    {
+      if (-1 == pr->probes[i].fd)
+        continue;
+      io_uring_prep_fgetxattr (probe_sqe (i), pr->probes[i].fd, PTIME_XATTR,
+                               (char *) &pr->ptimes[i],
+                               sizeof (pr->ptimes[i]));
+      queued++;
+    }
+  if (-1 == reap_all (queued, res))
+    return;
+  for (uint i = 0; i < pr->count; i++)
+    {
+      struct probe *p = &pr->probes[i];
+      if (-1 == p->fd)
+        continue;
+      // Kernels before 5.19 don't know this operation
+      if (-EINVAL == res[i])
+        PROBE.xattr = false;
+      if (!PROBE.xattr)
+        continue;
+      p->has_ptime = true;
+      p->ptime = parse_ptime (&pr->ptimes[i], 0 > res[i] ? -1 : res[i]);
+    }
+#endif
+}
+
+struct prober *
+prober_open (char *restrict * flist, int dirfd, struct law *l)
+{
+  assert (flist && l);
+  struct prober *pr;
+  if (!probe_setup ())
+    return NULL;
+  pr = malloc (sizeof (*pr));
+  if (!pr)
+    error (1, errno, "prober: malloc() failed");
+  pr->flist = flist;
+  pr->dirfd = dirfd;
+  pr->l = l;
+  pr->base = 0;
+  pr->count = 0;
+  return pr;
+}
+
+struct probe *
+prober_get (struct prober *pr, uint n)
+{
+  assert (pr && n >= pr->base);
+  if (n >= pr->base + pr->count)
+    probe_batch (pr, n);
+  if (n >= pr->base + pr->count || !pr->probed[n - pr->base])
+    return NULL;
+  return &pr->probes[n - pr->base];
+}
+
+void
+prober_close (struct prober *pr)
+{
+  assert (pr);
+  for (uint i = 0; i < pr->count; i++)
+    if (-1 != pr->probes[i].fd)
+      close (pr->probes[i].fd);
+  free (pr);
+}
+
+#else /* HAVE_LIBURING */
+
+struct prober *
+prober_open (char *restrict * flist, int dirfd, struct law *l)
+{
+  assert (flist && l);
+  (void) dirfd;
+  return NULL;
+}
+
+struct probe *
+prober_get (struct prober *pr, uint n)
+{
+  assert (!pr);
+  (void) n;
+  return NULL;
+}
+
+void
+prober_close (struct prober *pr)
+{
+  assert (!pr);
+}
+
+#endif /* HAVE_LIBURING */
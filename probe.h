@@ -0,0 +1,73 @@
+/***************************************************************************/
+/*  Copyright (C) 2026 Brice Arnould.                                      */
+/*                                                                         */
+/*  This file is part of ShaKe.                                            */
+/*                                                                         */
+/*  ShaKe is free software; you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by   */
+/*  the Free Software Foundation; either version 3 of the License, or      */
+/*  (at your option) any later version.                                    */
+/*                                                                         */
+/*  This program is distributed in the hope that it will be useful,        */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of         */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          */
+/*  GNU General Public License for more details.                           */
+/*                                                                         */
+/*  You should have received a copy of the GNU General Public License      */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+/***************************************************************************/
+
+#ifndef PROBE_H
+# define PROBE_H
+# include <stdbool.h>
+# include <sys/types.h>
+# include "judge.h"
+
+/*  A prober submits the stat(), open() and getxattr() that investigate()
+ * would make for the next PROBE_BATCH files of a list as one io_uring
+ * batch, so that the kernel can run them concurrently and reorder the
+ * inode reads, then hands the results out in the order of the list.
+ */
+# define PROBE_BATCH 64
+
+/* What investigate_probed() would otherwise ask the kernel
+ */
+struct probe
+{
+  int stat_errno;               // 0 if the fields below are valid
+  mode_t mode;
+  dev_t dev;
+  ino_t ino;
+  nlink_t nlink;
+  blkcnt_t blocks;              // in 512 bytes blocks
+  time_t atime;
+  time_t mtime;
+  time_t ctime;
+  int fd;                       // opened if needs_open(), or -1
+  int open_errno;               // 0 if fd is valid or open wasn't tried
+  bool has_ptime;               // false if ptime wasn't read
+  time_t ptime;                 // as get_ptime() returns it
+};
+
+/* A list of files being probed, opaque
+ */
+struct prober;
+
+/*  Start to probe the names of flist, relative to dirfd, for the law l.
+ * flist must stay valid until prober_close().
+ *  Returns NULL if io_uring can't be used.
+ */
+struct prober *prober_open (char *restrict * flist, int dirfd,
+                            struct law *l);
+
+/*  Returns the probe of flist[n], or NULL if probing it failed. The
+ * caller owns its fd, if any, and must set it to -1 if kept.
+ *  n must be greater than in the previous call.
+ */
+struct probe *prober_get (struct prober *pr, uint n);
+
+/*  Free pr and close the fds that weren't taken
+ */
+void prober_close (struct prober *pr);
+
+#endif /* PROBE_H */
@@ -0,0 +1,133 @@
+/***************************************************************************/
+/*  Copyright (C) 2026 Brice Arnould.                                      */
+/*                                                                         */
+/*  This file is part of ShaKe.                                            */
+/*                                                                         */
+/*  ShaKe is free software; you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by   */
+/*  the Free Software Foundation; either version 3 of the License, or      */
+/*  (at your option) any later version.                                    */
+/*                                                                         */
+/*  This program is distributed in the hope that it will be useful,        */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of         */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          */
+/*  GNU General Public License for more details.                           */
+/*                                                                         */
+/*  You should have received a copy of the GNU General Public License      */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+/***************************************************************************/
+#define _GNU_SOURCE
+#include "rank.h"
+#include "executive.h"          // accused_name()
+#include <stdlib.h>
+#include <string.h>             // strdup()
+#include <time.h>               // time()
+
+/*  Seeks a rewrite saves to a file that is only misplaced, and to a
+ * file that is only old: that one still helps to defragment the free
+ * space.
+ */
+#define MISPLACED_SEEKS 1.0
+#define OLD_SEEKS 0.25
+/* Days without being read after which a file counts half */
+#define HALF_LIFE 7.0
+
+/* A max-heap of the candidates, on their score */
+static struct
+{
+  struct candidate *c;
+  size_t count;
+  size_t size;                  // allocated
+} H;
+
+/*  Returns the seeks the rewrite of a saves to a read of it, per byte
+ * rewritten, weighted by how recently it was read
+ */
+static double
+score (struct accused *a, struct law *l)
+{
+  double seeks = a->fragc > 1 ? a->fragc - 1 : 0;
+  double bytes = a->size > 512 ? (double) a->size : 512;
+  double days = (double) (time (NULL) - a->atime) / (24 * 60 * 60);
+  /* A crumb costs a seek for almost no data, so it counts twice */
+  seeks += a->crumbc;
+  if (l->maxdeviance && a->start && a->ideal
+      && llabs (a->start - a->ideal) > (llint) l->maxdeviance)
+    seeks += MISPLACED_SEEKS;
+  if (a->age > l->old)
+    seeks += OLD_SEEKS;
+  /* The copy backend writes the file twice, to the backup and back */
+  if (BACKEND_COPY == a->backend)
+    bytes *= 2;
+  if (days < 0)
+    days = 0;
+  return seeks / (1 + days / HALF_LIFE) / bytes;
+}
+
+int
+rank_add (struct accused *a, struct law *l)
+{
+  struct candidate c = {
+    .score = score (a, l),
+    .size = a->size,
+    .ideal = a->ideal,
+    .fs = a->fs,
+    .ino = a->ino,
+    .mtime = a->mtime
+  };
+  size_t i;
+  if (H.count == H.size)
+    {
+      size_t size = H.size ? H.size * 2 : 1024;
+      struct candidate *tmp = realloc (H.c, size * sizeof (*H.c));
+      if (!tmp)
+        return -1;
+      H.c = tmp;
+      H.size = size;
+    }
+  c.name = strdup (accused_name (a));
+  if (!c.name)
+    return -1;
+  /* Sift up */
+  for (i = H.count++; i && H.c[(i - 1) / 2].score < c.score; i = (i - 1) / 2)
+    H.c[i] = H.c[(i - 1) / 2];
+  H.c[i] = c;
+  return 0;
+}
+
+bool
+rank_pop (struct candidate *c)
+{
+  struct candidate last;
+  size_t i = 0;
+  if (!H.count)
+    {
+      free (H.c);
+      H.c = NULL;
+      H.size = 0;
+      return false;
+    }
+  *c = H.c[0];
+  last = H.c[--H.count];
+  /* Sift down */
+  for (;;)
+    {
+      size_t child = 2 * i + 1;
+      if (child >= H.count)
+        break;
+      if (child + 1 < H.count && H.c[child + 1].score > H.c[child].score)
+        child++;
+      if (H.c[child].score <= last.score)
+        break;
+      H.c[i] = H.c[child];
+      i = child;
+    }
+  H.c[i] = last;
+  return true;
+}
+
+size_t
+rank_count (void)
+{
+  return H.count;
+}
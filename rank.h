@@ -0,0 +1,58 @@
+/***************************************************************************/
+/*  Copyright (C) 2026 Brice Arnould.                                      */
+/*                                                                         */
+/*  This file is part of ShaKe.                                            */
+/*                                                                         */
+/*  ShaKe is free software; you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by   */
+/*  the Free Software Foundation; either version 3 of the License, or      */
+/*  (at your option) any later version.                                    */
+/*                                                                         */
+/*  This program is distributed in the hope that it will be useful,        */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of         */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          */
+/*  GNU General Public License for more details.                           */
+/*                                                                         */
+/*  You should have received a copy of the GNU General Public License      */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+/***************************************************************************/
+#ifndef RANK_H
+# define RANK_H
+# include "judge.h"
+
+/*  With a byte or time budget, shake runs in two passes. The first one
+ * judges every file, but instead of shaking the guilty ones it scores
+ * them with rank_add(). The second one, judge_ranked(), shakes them
+ * from the best score down until the budget is spent.
+ *  The score is the read cost a rewrite saves, in seeks, per byte it
+ * rewrites, weighted by how recently the file was read: a file that
+ * nobody reads gains little from being contiguous.
+ *  Only the main thread judges, so the ranking has no lock.
+ */
+
+/* A guilty file, as recorded by the first pass */
+struct candidate
+{
+  double score;
+  char *name;			// path from the cwd, freed by the caller
+  llint size;			// bytes its rewrite will write
+  llint ideal;			// where the first pass wanted it to start
+  dev_t fs;
+  ino_t ino;
+  time_t mtime;			// the file is left alone if it changes
+};
+
+/*  Scores the guilty file a and records it. Returns -1 and sets errno
+ * if it can't.
+ */
+int rank_add (struct accused *a, struct law *l);
+
+/*  Moves the candidate with the best score to c. Returns false once
+ * none is left.
+ */
+bool rank_pop (struct candidate *c);
+
+/* Returns the number of candidates left */
+size_t rank_count (void);
+
+#endif /* RANK_H */
@@ -22,12 +22,13 @@
 #include <assert.h>		// assert()
 #include <errno.h>		// errno
 #include <error.h>		// error()
-#include <signal.h>		// sigaction, sigprocmask, sigsetops
+#include <signal.h>		// sigaction, sigsetops
+#include <pthread.h>		// pthread_sigmask()
 #include <unistd.h>		// unlink()
 #include <stdbool.h>
 
-/* Those variables would have to be put in a thread-specific storage
- * for ShaKe to be multithread
+/*  Only the main thread changes those variables, and only it runs the
+ * handlers, because the other threads call block_signals()
  */
 static const char *current_msg = NULL;
 static const char *current_tempfile = NULL;
@@ -126,7 +127,7 @@ enter_normal_mode (void)
   current_mode = NORMAL;
   current_msg = NULL;
   current_file = NULL;
-  sigprocmask (SIG_UNBLOCK, &sset, NULL);
+  pthread_sigmask (SIG_UNBLOCK, &sset, NULL);
 }
 
 void
@@ -145,6 +146,19 @@ enter_critical_mode (const char *msg)
   /* Stop and suspend works as usual */
   sigdelset (&sset, SIGTSTP);
   sigdelset (&sset, SIGSTOP);
-  sigprocmask (SIG_BLOCK, &sset, NULL);
+  pthread_sigmask (SIG_BLOCK, &sset, NULL);
   current_mode = CRITICAL;
 }
+
+void
+block_signals (void)
+{
+  sigset_t sset;
+  sigfillset (&sset);
+  /* Those are sent to the thread that raised them */
+  sigdelset (&sset, SIGILL);
+  sigdelset (&sset, SIGFPE);
+  sigdelset (&sset, SIGSEGV);
+  sigdelset (&sset, SIGBUS);
+  pthread_sigmask (SIG_BLOCK, &sset, NULL);
+}
@@ -54,4 +54,10 @@ void enter_critical_mode (const char *msg);
  */
 void enter_normal_mode (void);
 
+/*  Block the signals in the calling thread, so that they are handled
+ * by the main thread, whatever the mode. Helper threads must call it
+ * first.
+ */
+void block_signals (void);
+
 #endif
@@ -0,0 +1,441 @@
+/***************************************************************************/
+/*  Copyright (C) 2026 Brice Arnould.                                      */
+/*                                                                         */
+/*  This file is part of ShaKe.                                            */
+/*                                                                         */
+/*  ShaKe is free software; you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by   */
+/*  the Free Software Foundation; either version 3 of the License, or      */
+/*  (at your option) any later version.                                    */
+/*                                                                         */
+/*  This program is distributed in the hope that it will be useful,        */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of         */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          */
+/*  GNU General Public License for more details.                           */
+/*                                                                         */
+/*  You should have received a copy of the GNU General Public License      */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+/***************************************************************************/
+
+#include "throttle.h"
+#include "linux.h"              // read_io_pressure(), read_disk_stats()
+#include <stdio.h>              // fopen(), fscanf()
+#include <time.h>               // clock_gettime(), nanosleep()
+#include <errno.h>
+#include <error.h>              // error()
+#include <unistd.h>             // close()
+
+/* Transfers throttle_chunk() lets go at once, in fractions of a second */
+#define CHUNKS_PER_SECOND 10
+/* The smallest chunk throttle_chunk() returns */
+#define MIN_CHUNK (64 * 1024)
+
+/*  The pacer reads the pressure and the device counters every
+ * SAMPLE_PERIOD seconds. Past PRESSURE_HIGH of the time with tasks
+ * stalled on I/O, or with a latency LATENCY_FACTOR times the lowest
+ * seen, or with QUEUED_BUSY requests of the others in progress, it
+ * halves the rate. Under PRESSURE_LOW and without latency, it raises
+ * it by RAMP_UP.
+ */
+#define SAMPLE_PERIOD 0.2
+#define PRESSURE_HIGH 0.10
+#define PRESSURE_LOW 0.02
+#define LATENCY_FACTOR 4
+#define QUEUED_BUSY 4
+#define RAMP_UP 1.25
+#define MIN_RATE (1024 * 1024.)
+#define START_RATE (16 * 1024 * 1024.)
+#define MAX_RATE (1024 * 1024 * 1024.)  // when no --max-rate is given
+
+/*  The idle window scheduler calls a disk quiet when it was busy less
+ * than QUIET_BUSY of the time since the last sample. Until it has seen
+ * shake copy for a second, it assumes QUIET_SPEED bytes per second.
+ * WINDOW_WEIGHT is the weight of the last idle window in the average.
+ * A copy that QUIET_MISSES idle windows in a row were too short for is
+ * given up. A copy paused while the disk is busy resumes after
+ * PAUSE_MAX seconds anyway, as it holds a lock on its file.
+ */
+#define QUIET_BUSY 0.05
+#define QUIET_SPEED (16 * 1024 * 1024.)
+#define WINDOW_WEIGHT 0.25
+#define QUIET_MISSES 3
+#define PAUSE_MAX 30
+
+static struct
+{
+  double max_rate;              // bytes per second, 0 for no limit
+  double rate;                  // max_rate, or what the pacer allows
+  double iops;                  // operations per second, 0 for no limit
+  double bytes;                 // tokens left, negative if in debt
+  double ops;
+  double last;                  // when the buckets were filled
+  const char *file;             // where the limits are read, or NULL
+  bool file_ok;                 // the last read of file succeeded
+  double checked;               // when file was read
+  /* The pacer, if adaptive */
+  bool adaptive;
+  bool busy;                    // the last sample saw the others wait
+  dev_t dev;                    // device being copied, -1 if unknown
+  double sampled;               // when the counters were read
+  double returned;              // when throttle() last returned
+  double own;                   // time spent copying since sampled
+  llint stall;                  // total of read_io_pressure(), or -1
+  struct disk_stats ds;         // of dev, ds.ios is -1 if unknown
+  double baseline;              // lowest latency seen, in ms
+  /* The idle window scheduler, if quiet */
+  double quiet;                 // seconds the disk must have been idle
+  dev_t quiet_dev;              // device whose disk busy_fd is
+  int busy_fd;                  // see open_busy_time(), -1 if none
+  llint busy_ms;                // read_busy_time() at quiet_sampled
+  double quiet_sampled;
+  bool own_io;                  // shake copied since quiet_sampled
+  double idle_since;            // start of the idle window, -1 if busy
+  double window;                // average length of the idle windows
+  double copied;                // bytes copied, for the speed estimate
+  double copy_time;             // seconds spent copying them
+  bool hold;                    // see throttle_hold()
+} T;
+
+/* Returns the monotonic time in seconds */
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* Returns -1 if a signal came before the end, else 0 */
+static int
+sleep_for (double seconds)
+{
+  struct timespec ts;
+  ts.tv_sec = (time_t) seconds;
+  ts.tv_nsec = (long) ((seconds - (double) ts.tv_sec) * 1e9);
+  return nanosleep (&ts, NULL);
+}
+
+/*  Reads the limits from T.file. Returns -1 if failed, else 0.
+ */
+static int
+read_limits (void)
+{
+  FILE *f = fopen (T.file, "r");
+  llint rate, iops;
+  int res = -1;
+  if (f)
+    {
+      if (2 == fscanf (f, "%lli %lli", &rate, &iops) && rate >= 0
+          && iops >= 0)
+        {
+          T.max_rate = (double) rate * 1000;
+          T.iops = (double) iops;
+          if (!T.adaptive)
+            T.rate = T.max_rate;
+          res = 0;
+        }
+      else
+        errno = EINVAL;
+      fclose (f);
+    }
+  /* Only say it once, this is called every second */
+  if (-1 == res && T.file_ok)
+    error (0, errno, "%s: can't read the limits, keeping them", T.file);
+  T.file_ok = 0 == res;
+  return res;
+}
+
+/*  Reads the counters, and adapts T.rate to what they say. The stalls
+ * of shake itself, that is roughly the time it spent copying, are not
+ * counted as pressure.
+ */
+static void
+sample (double t)
+{
+  double elapsed = t - T.sampled;
+  double pressure = 0;
+  bool slow = false;
+  llint stall;
+  struct disk_stats ds;
+  if (-1 != T.stall && 0 == read_io_pressure (&stall))
+    {
+      pressure = ((double) (stall - T.stall) / 1e6 - T.own) / elapsed;
+      T.stall = stall;
+    }
+  if ((dev_t) - 1 != T.dev && 0 == read_disk_stats (T.dev, &ds))
+    {
+      if (-1 != T.ds.ios && ds.ios > T.ds.ios)
+        {
+          double latency = (double) (ds.ticks - T.ds.ticks)
+            / (double) (ds.ios - T.ds.ios);
+          if (!T.baseline || latency < T.baseline)
+            T.baseline = latency;
+          slow = latency > LATENCY_FACTOR * T.baseline + 1;
+        }
+      /* Unless shake copied meanwhile, the requests queued are not its */
+      if (!T.own && ds.inflight >= QUEUED_BUSY)
+        slow = true;
+      T.ds = ds;
+    }
+  else
+    T.ds.ios = -1;
+  T.sampled = t;
+  T.own = 0;
+  T.busy = slow || pressure > PRESSURE_HIGH;
+  if (!T.adaptive)
+    return;                     // only the scheduler needs T.busy
+  if (T.busy)
+    T.rate /= 2;
+  else if (pressure < PRESSURE_LOW)
+    T.rate *= RAMP_UP;
+  if (T.rate < MIN_RATE)
+    T.rate = MIN_RATE;
+  if (T.rate > (T.max_rate ? T.max_rate : MAX_RATE))
+    T.rate = T.max_rate ? T.max_rate : MAX_RATE;
+}
+
+/*  Reads how long the disk was busy since the last call, and opens or
+ * closes the idle window.
+ */
+static void
+sample_disk (double t)
+{
+  llint busy;
+  if (-1 == read_busy_time (T.busy_fd, &busy))
+    return;
+  if ((double) (busy - T.busy_ms) > QUIET_BUSY * 1000 * (t - T.quiet_sampled))
+    {
+      double len = T.quiet_sampled - T.idle_since;
+      if (T.idle_since >= 0)
+        T.window = T.window ? (1 - WINDOW_WEIGHT) * T.window
+          + WINDOW_WEIGHT * len : len;
+      T.idle_since = -1;
+    }
+  else if (T.idle_since < 0)
+    T.idle_since = T.quiet_sampled;
+  T.busy_ms = busy;
+  T.quiet_sampled = t;
+}
+
+/*  Starts the samples of the pacer over, the stalls seen while the
+ * scheduler waited are not the copy's doing.
+ */
+static void
+restart_pacer (double t)
+{
+  if (-1 != T.stall)
+    read_io_pressure (&T.stall);
+  if ((dev_t) - 1 != T.dev && -1 == read_disk_stats (T.dev, &T.ds))
+    T.ds.ios = -1;
+  T.busy = false;
+  T.sampled = t;
+  T.own = 0;
+}
+
+/*  Starts the samples of the disk over, what it did meanwhile is
+ * unknown or was done by shake.
+ */
+static void
+restart_disk (double t)
+{
+  if (0 == read_busy_time (T.busy_fd, &T.busy_ms))
+    T.quiet_sampled = t;
+  T.own_io = false;
+}
+
+/*  Waits until the disk has been quiet for T.quiet seconds, and should
+ * stay so for needed more seconds. Returns -1 if a signal came
+ * meanwhile, 1 if QUIET_MISSES quiet windows ended before needed
+ * seemed to fit or if limit seconds passed, else 0. limit is 0 for no
+ * limit.
+ */
+static int
+wait_quiet (double needed, double limit)
+{
+  uint misses = 0;
+  bool quiet = false;           // the current window is long enough
+  double end = now () + limit;
+  while (1)
+    {
+      double t = now ();
+      if (limit && t >= end)
+        return 1;
+      if (t - T.quiet_sampled >= SAMPLE_PERIOD)
+        sample_disk (t);
+      if (T.idle_since >= 0)
+        {
+          double idle = t - T.idle_since;
+          /* A window is expected to last at least as long again */
+          double left = T.window - idle > idle ? T.window - idle : idle;
+          quiet = idle >= T.quiet;
+          if (quiet && needed <= left)
+            return 0;
+        }
+      else if (quiet)
+        {
+          quiet = false;
+          if (++misses >= QUIET_MISSES)
+            return 1;
+        }
+      if (-1 == sleep_for (SAMPLE_PERIOD))
+        return -1;
+    }
+}
+
+int
+throttle_setup (llint rate, llint iops, const char *file, bool adaptive,
+                uint quiet)
+{
+  T.max_rate = (double) rate;
+  T.iops = (double) iops;
+  T.file = file;
+  T.file_ok = false;            // the caller says it if this read fails
+  T.adaptive = adaptive;
+  T.quiet = quiet;
+  T.quiet_dev = (dev_t) - 1;
+  T.busy_fd = -1;
+  T.last = T.checked = T.sampled = T.returned = now ();
+  if (file && -1 == read_limits ())
+    return -1;
+  T.rate = T.max_rate;
+  if (adaptive && (!T.rate || T.rate > START_RATE))
+    T.rate = START_RATE;
+  /* The scheduler uses the pacer to see when the others need the disk */
+  if (adaptive || quiet)
+    {
+      if (-1 == read_io_pressure (&T.stall))
+        T.stall = -1;
+      T.dev = (dev_t) - 1;
+      T.ds.ios = -1;
+    }
+  T.bytes = T.rate;
+  T.ops = T.iops;
+  return 0;
+}
+
+void
+throttle_device (dev_t dev)
+{
+  if ((T.adaptive || T.quiet) && dev != T.dev)
+    {
+      T.dev = dev;
+      T.ds.ios = -1;
+      T.baseline = 0;
+    }
+}
+
+llint
+throttle_chunk (llint len)
+{
+  llint max = (llint) T.rate / CHUNKS_PER_SECOND;
+  if (!T.rate || len <= max)
+    return len;
+  return max > MIN_CHUNK ? max : MIN_CHUNK;
+}
+
+int
+throttle_quiet (dev_t dev, llint len)
+{
+  double speed = T.copy_time >= 1 ? T.copied / T.copy_time : QUIET_SPEED;
+  int res;
+  if (!T.quiet)
+    return 0;
+  if (dev != T.quiet_dev)
+    {
+      if (-1 != T.busy_fd)
+        close (T.busy_fd);
+      T.busy_fd = open_busy_time (dev);
+      T.quiet_dev = dev;
+      T.idle_since = -1;
+      T.window = 0;
+      T.own_io = true;
+    }
+  if (-1 == T.busy_fd)
+    return 0;                   // no disk of its own, eg. on btrfs or NFS
+  if (T.own_io)
+    restart_disk (now ());
+  /* No lock is held yet, a signal is no reason to start early */
+  while (-1 == (res = wait_quiet ((double) len / speed, 0)))
+    continue;
+  restart_pacer (T.returned = now ());
+  return res;
+}
+
+void
+throttle_hold (bool hold)
+{
+  T.hold = hold;
+}
+
+void
+throttle_pause (void)
+{
+  double t;
+  if (!T.adaptive)
+    return;
+  t = now ();
+  if (t - T.sampled >= SAMPLE_PERIOD)
+    sample (t);
+  /* Let the others be served before investigating the next file */
+  if (T.busy)
+    {
+      sleep_for (SAMPLE_PERIOD);
+      sample (now ());
+    }
+  T.returned = now ();
+}
+
+void
+throttle (llint len)
+{
+  double t, wait = 0;
+  if (!T.file && !T.rate && !T.iops && !T.quiet)
+    return;
+  t = now ();
+  if (T.file && t - T.checked >= 1)
+    {
+      T.checked = t;
+      read_limits ();
+    }
+  if (T.adaptive || T.quiet)
+    {
+      /* The time since the last return was spent copying */
+      T.own += t - T.returned;
+      T.copy_time += t - T.returned;
+      if (t - T.sampled >= SAMPLE_PERIOD)
+        sample (t);
+    }
+  T.copied += (double) len;
+  T.own_io = true;
+  /* Leave the disk to the others, resume once it is quiet again */
+  if (T.quiet && T.busy && -1 != T.busy_fd && !T.hold)
+    {
+      restart_disk (t);
+      T.idle_since = -1;
+      if (-1 == wait_quiet (0, PAUSE_MAX))
+        {
+          T.returned = T.last = now ();
+          return;               // the caller may have lost its lock
+        }
+      T.own_io = true;
+      restart_pacer (t = T.last = now ());
+    }
+  /* Fill the buckets, up to a second worth of tokens */
+  T.bytes += (t - T.last) * T.rate;
+  if (T.bytes > T.rate)
+    T.bytes = T.rate;
+  T.ops += (t - T.last) * T.iops;
+  if (T.ops > T.iops)
+    T.ops = T.iops;
+  T.last = t;
+  /* Take the tokens, then wait until there is no debt */
+  T.bytes -= (double) len;
+  T.ops -= 1;
+  if (T.rate && -T.bytes / T.rate > wait)
+    wait = -T.bytes / T.rate;
+  if (T.iops && -T.ops / T.iops > wait)
+    wait = -T.ops / T.iops;
+  if (wait > 0)
+    sleep_for (wait);
+  T.returned = now ();
+}
@@ -0,0 +1,89 @@
+/***************************************************************************/
+/*  Copyright (C) 2026 Brice Arnould.                                      */
+/*                                                                         */
+/*  This file is part of ShaKe.                                            */
+/*                                                                         */
+/*  ShaKe is free software; you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by   */
+/*  the Free Software Foundation; either version 3 of the License, or      */
+/*  (at your option) any later version.                                    */
+/*                                                                         */
+/*  This program is distributed in the hope that it will be useful,        */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of         */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          */
+/*  GNU General Public License for more details.                           */
+/*                                                                         */
+/*  You should have received a copy of the GNU General Public License      */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+/***************************************************************************/
+
+#ifndef THROTTLE_H
+# define THROTTLE_H
+# include "judge.h"
+
+/*  The throttle limits the bytes and the operations per second of the
+ * copies made by fcopy(), for the backups as for the rewrites, and of
+ * the moves of the ext4 backend, so that shake leaves the disk to the
+ * other processes. Each limit is a token bucket holding up to a second
+ * worth of transfers.
+ *  If adaptive, the rate is instead set by a pacer, under the limit if
+ * any: it reads /proc/pressure/io and the /proc/diskstats of the device
+ * being copied, backs off when the other tasks wait for I/O, and ramps
+ * up when the device is idle. throttle_pause() also lets it slow down
+ * the investigation of the files.
+ *  If quiet, an idle window scheduler also watches how busy the disk
+ * is, from sysfs: a file is only rewritten once the disk has been idle
+ * for that many seconds, and if the rewrite should be done before the
+ * idle window ends, judging from the windows seen so far. When the
+ * pacer sees the others wait for I/O during a copy, the copy pauses
+ * until the disk is quiet again, for a while at most, and never while
+ * held (see throttle_hold()).
+ *  Only the main thread copies, so the throttle has no lock.
+ */
+
+/*  Sets the limits, in bytes and operations per second, 0 for none,
+ * whether the pacer adapts the rate, and the seconds of idleness the
+ * scheduler waits for, 0 for no scheduler.
+ * If file isn't NULL, the limits are read from it instead, and read
+ * again every second while copying, so that they can be changed during
+ * a long run. It holds the kB per second, then the operations per
+ * second, as --max-rate and --max-iops.
+ *  Returns -1 if file can't be read, else 0.
+ */
+int throttle_setup (llint rate, llint iops, const char *file,
+                    bool adaptive, uint quiet);
+
+/*  Tells the pacer on which device the next copies are.
+ */
+void throttle_device (dev_t dev);
+
+/*  Called before the rewrite of a file of dev that will transfer len
+ * bytes, waits until the scheduler lets it start.
+ *  Returns 1 if the rewrite doesn't fit the idle windows of the disk
+ * and should be skipped, else 0.
+ */
+int throttle_quiet (dev_t dev, llint len);
+
+/*  Returns len, or less if the byte limit would make it a burst, for
+ * the callers that can split their transfers.
+ */
+llint throttle_chunk (llint len);
+
+/*  Waits until len bytes can be transferred, in one operation, and
+ * while the scheduler pauses the copy. Returns earlier if a signal
+ * comes, so that the caller can check its lock.
+ */
+void throttle (llint len);
+
+/*  While held, throttle() doesn't pause the copy for the scheduler. Used
+ * while a file is rewritten from its backup: it is then truncated, so
+ * the copy has to end as soon as it can.
+ */
+void throttle_hold (bool hold);
+
+/*  Called between files, waits while the pacer sees the other tasks
+ * stalled on I/O.
+ */
+void throttle_pause (void);
+
+#endif /* THROTTLE_H */
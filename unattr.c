@@ -19,6 +19,7 @@
 
 /*** unattr: quick and dirty hack to remove unwanted Xattrs ****/
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
@@ -67,7 +68,15 @@ look (char *name, char **attr)
   else if (S_ISDIR (st.st_mode))	// directory
     {
       /* list it */
-      char **flist = list_dir (name, false);
+      char **flist;
+      int fd = open (name, O_RDONLY | O_DIRECTORY);
+      if (0 > fd)
+	{
+	  error (0, errno, "%s: open() failed", name);
+	  return;
+	}
+      flist = list_dir (fd, name, ORDER_NONE, 0);
+      close (fd);
       if (!flist)
 	{
 	  error (0, 0, "%s: list_dir() failed", name);
@@ -75,11 +84,8 @@ look (char *name, char **attr)
 	}
       /* Go through the list */
       for (char **name = flist; *name; name++)
-	{
-	  look (*name, attr);
-	  free (*name);
-	}
-      free (flist);
+	look (*name, attr);
+      close_list (flist);
     }
 }
 
@@ -165,6 +171,8 @@ main (int argc, char **argv)
     for (; optind < argc; optind++)
       look (argv[optind], attr);
   /* free */
-  close_list (attr);
+  for (char **a = attr; *a; a++)
+    free (*a);
+  free (attr);
   return 0;
 }
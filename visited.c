@@ -0,0 +1,163 @@
+/***************************************************************************/
+/*  Copyright (C) 2026 Brice Arnould.                                      */
+/*                                                                         */
+/*  This file is part of ShaKe.                                            */
+/*                                                                         */
+/*  ShaKe is free software; you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by   */
+/*  the Free Software Foundation; either version 3 of the License, or      */
+/*  (at your option) any later version.                                    */
+/*                                                                         */
+/*  This program is distributed in the hope that it will be useful,        */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of         */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          */
+/*  GNU General Public License for more details.                           */
+/*                                                                         */
+/*  You should have received a copy of the GNU General Public License      */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+/***************************************************************************/
+
+#include "visited.h"
+#include <stdlib.h>
+#include <stdint.h>             // uint64_t
+#include <errno.h>
+#include <error.h>              // error()
+#include <pthread.h>
+
+/* Bits of the Bloom filter, and bits set per inode */
+#define BLOOM_BITS (1 << 25)
+#define BLOOM_HASHES 4
+
+/* An inode, both fields are 0 in free slots */
+struct key
+{
+  dev_t dev;
+  ino_t ino;
+};
+
+static struct
+{
+  pthread_mutex_t lock;
+  struct key *slots;
+  size_t size;                  // number of slots, a power of 2
+  size_t count;                 // used slots
+  uint64_t *bloom;              // NULL until the table is full
+} V = {
+.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Mixes the bits of an inode, see splitmix64 */
+static uint64_t
+hash (dev_t dev, ino_t ino)
+{
+  uint64_t h = (uint64_t) ino ^ ((uint64_t) dev * 0x9e3779b97f4a7c15ULL);
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+/*  Returns the slot of key in the table, or the free slot where it
+ * would go
+ */
+static struct key *
+lookup (struct key k, uint64_t h)
+{
+  size_t mask = V.size - 1;
+  for (size_t i = h & mask;; i = (i + 1) & mask)
+    {
+      struct key *s = V.slots + i;
+      if ((s->dev == k.dev && s->ino == k.ino) || (!s->dev && !s->ino))
+        return s;
+    }
+}
+
+/*  Doubles the table, returns -1 if it can't
+ */
+static int
+grow (void)
+{
+  struct key *old = V.slots;
+  size_t oldsize = V.size;
+  V.size = oldsize ? oldsize * 2 : 1024;
+  V.slots = calloc (V.size, sizeof (*V.slots));
+  if (!V.slots)
+    {
+      V.slots = old;
+      V.size = oldsize;
+      return -1;
+    }
+  for (size_t i = 0; i < oldsize; i++)
+    if (old[i].dev || old[i].ino)
+      *lookup (old[i], hash (old[i].dev, old[i].ino)) = old[i];
+  free (old);
+  return 0;
+}
+
+/*  Sets the bits of h in the Bloom filter, returns true if they all
+ * were already set. The hashes are derived from h, see Kirsch and
+ * Mitzenmacher, "Less Hashing, Same Performance".
+ */
+static bool
+bloom_add (uint64_t h)
+{
+  uint32_t h1 = (uint32_t) h, h2 = (uint32_t) (h >> 32) | 1;
+  bool seen = true;
+  for (uint32_t i = 0; i < BLOOM_HASHES; i++)
+    {
+      uint32_t bit = (h1 + i * h2) % BLOOM_BITS;
+      uint64_t mask = (uint64_t) 1 << (bit % 64);
+      if (!(V.bloom[bit / 64] & mask))
+        {
+          V.bloom[bit / 64] |= mask;
+          seen = false;
+        }
+    }
+  return seen;
+}
+
+bool
+visit (dev_t dev, ino_t ino, bool exact)
+{
+  struct key k = {.dev = dev,.ino = ino };
+  uint64_t h = hash (dev, ino);
+  bool seen;
+  pthread_mutex_lock (&V.lock);
+  /*  Keep the load under 1/2. Past VISITED_MAX, the table only grows
+   * for exact inodes.
+   */
+  if (2 * (V.count + 1) > V.size
+      && (exact || (!V.bloom && V.count < VISITED_MAX)) && -1 == grow ()
+      && exact)
+    error (1, errno, "malloc() failed");
+  if (2 * (V.count + 1) > V.size && !exact && !V.bloom)
+    {
+      V.bloom = calloc (BLOOM_BITS / 64, sizeof (*V.bloom));
+      if (!V.bloom)
+        error (1, errno, "malloc() failed");
+    }
+  {
+    struct key *s = V.slots ? lookup (k, h) : NULL;
+    seen = s && (s->dev || s->ino);
+    /* Once the filter is used, other inodes may be in it */
+    if (!seen && (exact || !V.bloom))
+      {
+        *s = k;
+        V.count++;
+      }
+    else if (!seen)
+      seen = bloom_add (h);
+  }
+  pthread_mutex_unlock (&V.lock);
+  return seen;
+}
+
+void
+forget_visits (void)
+{
+  pthread_mutex_lock (&V.lock);
+  free (V.slots);
+  free (V.bloom);
+  V.slots = NULL;
+  V.bloom = NULL;
+  V.size = V.count = 0;
+  pthread_mutex_unlock (&V.lock);
+}
@@ -0,0 +1,47 @@
+/***************************************************************************/
+/*  Copyright (C) 2026 Brice Arnould.                                      */
+/*                                                                         */
+/*  This file is part of ShaKe.                                            */
+/*                                                                         */
+/*  ShaKe is free software; you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by   */
+/*  the Free Software Foundation; either version 3 of the License, or      */
+/*  (at your option) any later version.                                    */
+/*                                                                         */
+/*  This program is distributed in the hope that it will be useful,        */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of         */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          */
+/*  GNU General Public License for more details.                           */
+/*                                                                         */
+/*  You should have received a copy of the GNU General Public License      */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+/***************************************************************************/
+
+#ifndef VISITED_H
+# define VISITED_H
+# include <stdbool.h>
+# include <sys/types.h>
+
+/*  The visited set remembers the inodes investigate() has seen, so that
+ * a file reached through several hard links, or a tree reached through
+ * several bind mounts, is judged only once per run.
+ *  Inodes are kept in an open addressing hash table. Past VISITED_MAX
+ * of them, the new files go in a Bloom filter instead, so that memory
+ * stays bounded on huge scans. The filter can then take a file for
+ * visited when it isn't, so it is not shaken by this run. Directories
+ * always go in the table, as such a mistake would skip a whole tree.
+ */
+# define VISITED_MAX (1 << 20)
+
+/*  Records that the inode ino of the filesystem dev is visited. Returns
+ * true if it already was. If exact, the answer is never wrong, use it
+ * for directories. Can be called by any thread.
+ */
+bool visit (dev_t dev, ino_t ino, bool exact);
+
+/*  Forgets every inode, so that a new pass over the same files can
+ * visit them again.
+ */
+void forget_visits (void);
+
+#endif /* VISITED_H */
@@ -0,0 +1,460 @@
+/***************************************************************************/
+/*  Copyright (C) 2026 Brice Arnould.                                      */
+/*                                                                         */
+/*  This file is part of ShaKe.                                            */
+/*                                                                         */
+/*  ShaKe is free software; you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by   */
+/*  the Free Software Foundation; either version 3 of the License, or      */
+/*  (at your option) any later version.                                    */
+/*                                                                         */
+/*  This program is distributed in the hope that it will be useful,        */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of         */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          */
+/*  GNU General Public License for more details.                           */
+/*                                                                         */
+/*  You should have received a copy of the GNU General Public License      */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+/***************************************************************************/
+
+#define _GNU_SOURCE
+#include "walker.h"
+#include "executive.h"          // list_dir(), accused_name()
+#include "signals.h"            // block_signals()
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <error.h>              // error()
+#include <fcntl.h>              // openat()
+#include <pthread.h>
+#include <stdint.h>             // uintptr_t
+#include <unistd.h>             // close()
+#include <sys/stat.h>           // S_ISDIR()
+
+/* Files queued per thread, in addition to the one being judged
+ */
+#define WINDOW_PER_JOB 4
+
+enum slot_state
+{
+  QUEUED,                       // waits in a deque
+  RUNNING,                      // taken by a thread, or by walk_result()
+  DONE,                         // a holds the result
+};
+
+/* A file to investigate
+ */
+struct slot
+{
+  struct walk *w;
+  const char *leaf;
+  int state;                    // enum slot_state, see __atomic builtins
+  struct accused *a;            // set when state is DONE
+};
+
+struct walk
+{
+  int dirfd;
+  const char *dir;
+  struct slot *slots;
+  uint count;                   // number of slots
+  uint queued;                  // slots[0..queued[ have been queued
+  uint pending;                 // slots still referenced by deques, atomic
+  bool cancelled;               // walk_close() has been called
+  bool ahead;                   // started by a thread, not yet adopted
+  uint levels;                  // see walk_list()
+};
+
+/* A ring of slots, protected by its own mutex
+ */
+struct deque
+{
+  pthread_mutex_t lock;
+  struct slot **items;
+  uint size;                    // allocated items
+  uint front;                   // position of the first item
+  uint len;                     // number of items
+};
+
+/*  The walker itself. Counters are read and written with the __atomic
+ * builtins, W.lock is only taken to sleep or to wake up a sleeper.
+ */
+static struct
+{
+  uint jobs;                    // number of deques, 0 if not started
+  struct law *l;
+  pthread_t *threads;
+  uint threadc;                 // threads actually started
+  struct deque *deques;
+  uint next;                    // deque which receives the next slot
+  pthread_mutex_t lock;
+  pthread_cond_t work;          // a slot was queued, or stop was set
+  pthread_cond_t done;          // a slot was done, or left a deque
+  uint waiting;                 // number of slots in the deques
+  uint ahead;                   // directories listed in advance
+  uint sleepers;                // threads waiting for work
+  bool watching;                // the main thread waits for done
+  bool stop;
+} W = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .work = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void
+push_back (struct deque *d, struct slot *s)
+{
+  pthread_mutex_lock (&d->lock);
+  if (d->len == d->size)
+    {
+      uint size = d->size ? d->size * 2 : 16;
+      struct slot **items = malloc (size * sizeof (*items));
+      if (!items)
+        error (1, errno, "walker: malloc() failed");
+      for (uint i = 0; i < d->len; i++)
+        items[i] = d->items[(d->front + i) % d->size];
+      free (d->items);
+      d->items = items;
+      d->size = size;
+      d->front = 0;
+    }
+  d->items[(d->front + d->len) % d->size] = s;
+  d->len++;
+  pthread_mutex_unlock (&d->lock);
+}
+
+/*  Remove a slot from the front of d if own, else from the back.
+ * Returns NULL if d is empty.
+ */
+static struct slot *
+pop (struct deque *d, bool own)
+{
+  struct slot *s = NULL;
+  pthread_mutex_lock (&d->lock);
+  if (d->len)
+    {
+      if (own)
+        {
+          s = d->items[d->front];
+          d->front = (d->front + 1) % d->size;
+        }
+      else
+        s = d->items[(d->front + d->len - 1) % d->size];
+      d->len--;
+    }
+  pthread_mutex_unlock (&d->lock);
+  return s;
+}
+
+/*  Take a slot from the deque self, or steal one from the others.
+ */
+static struct slot *
+take (uint self)
+{
+  struct slot *s = pop (&W.deques[self], true);
+  for (uint i = 1; !s && i < W.jobs; i++)
+    s = pop (&W.deques[(self + i) % W.jobs], false);
+  if (s)
+    __atomic_sub_fetch (&W.waiting, 1, __ATOMIC_SEQ_CST);
+  return s;
+}
+
+static struct walk *new_walk (char *restrict * flist, int dirfd,
+                              const char *dir, uint levels);
+static void queue_until (struct walk *w, uint end, int deque);
+
+/*  Lists the directory a, found by the walk w, in advance and queues
+ * its first names in the deque self, unless W.jobs directories already
+ * are. Only directories judge_dir() will read relative to their fd are,
+ * else their subdirectories would be visit()ed twice.
+ */
+static void
+list_ahead (struct walk *w, struct accused *a, uint self)
+{
+  struct law *l = W.l;
+  if (!a->dir || !w->levels
+      || ((dev_t) - 1 != l->kingdom && a->fs != l->kingdom))
+    return;
+  if (__atomic_add_fetch (&W.ahead, 1, __ATOMIC_SEQ_CST) > W.jobs)
+    goto cancel;
+  /* On failure, judge_dir() tries again and shows the error */
+  a->fd = openat (a->dirfd, a->leaf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (-1 == a->fd)
+    goto cancel;
+  a->ahead = list_dir (a->fd, NULL, l->order, l->reorder);
+  if (!a->ahead || !a->ahead[0])
+    {
+      if (a->ahead)
+        close_list (a->ahead);
+      a->ahead = NULL;
+      close (a->fd);
+      a->fd = -1;
+      goto cancel;
+    }
+  a->walk = new_walk (a->ahead, a->fd, accused_name (a), w->levels - 1);
+  a->walk->ahead = true;
+  queue_until (a->walk, WINDOW_PER_JOB, (int) self);
+  return;
+cancel:
+  __atomic_sub_fetch (&W.ahead, 1, __ATOMIC_SEQ_CST);
+}
+
+/*  Investigate the file of s unless walk_result() already took it, and
+ * list it in advance if it is a directory and self isn't -1.
+ * Returns true if it did.
+ */
+static bool
+run (struct slot *s, int self)
+{
+  int expected = QUEUED;
+  if (!__atomic_compare_exchange_n (&s->state, &expected, RUNNING, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return false;
+  if (!__atomic_load_n (&s->w->cancelled, __ATOMIC_ACQUIRE))
+    {
+      s->a = investigate (s->w->dirfd, s->w->dir, s->leaf, W.l);
+      if (-1 != self && s->a && S_ISDIR (s->a->mode)
+          && !__atomic_load_n (&s->w->cancelled, __ATOMIC_ACQUIRE))
+        list_ahead (s->w, s->a, (uint) self);
+    }
+  __atomic_store_n (&s->state, DONE, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+/*  Wake up the threads waiting on cond.
+ *  Callers change the awaited value before checking W.sleepers or
+ * W.watching, and sleepers set those before checking the value, so
+ * that one of them always sees the other.
+ */
+static void
+wake (pthread_cond_t * cond, bool all)
+{
+  pthread_mutex_lock (&W.lock);
+  if (all)
+    pthread_cond_broadcast (cond);
+  else
+    pthread_cond_signal (cond);
+  pthread_mutex_unlock (&W.lock);
+}
+
+static void *
+work (void *arg)
+{
+  uint self = (uint) (uintptr_t) arg;
+  /* Leave the signals to the main thread, see signals.c */
+  block_signals ();
+  while (true)
+    {
+      struct slot *s = take (self);
+      if (!s)
+        {
+          bool stop;
+          pthread_mutex_lock (&W.lock);
+          __atomic_add_fetch (&W.sleepers, 1, __ATOMIC_SEQ_CST);
+          while (!W.stop && !__atomic_load_n (&W.waiting, __ATOMIC_SEQ_CST))
+            pthread_cond_wait (&W.work, &W.lock);
+          __atomic_sub_fetch (&W.sleepers, 1, __ATOMIC_SEQ_CST);
+          stop = W.stop && !__atomic_load_n (&W.waiting, __ATOMIC_SEQ_CST);
+          pthread_mutex_unlock (&W.lock);
+          if (stop)
+            return NULL;
+          continue;
+        }
+      run (s, (int) self);
+      /* The walk can be freed as soon as pending reaches 0 */
+      __atomic_sub_fetch (&s->w->pending, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n (&W.watching, __ATOMIC_SEQ_CST))
+        wake (&W.done, true);
+    }
+}
+
+int
+walker_start (uint jobs, struct law *l)
+{
+  assert (!W.jobs && jobs && l);
+  W.l = l;
+  W.stop = false;
+  W.next = 0;
+  W.waiting = 0;
+  W.ahead = 0;
+  W.sleepers = 0;
+  W.watching = false;
+  W.threads = malloc (jobs * sizeof (*W.threads));
+  W.deques = calloc (jobs, sizeof (*W.deques));
+  if (!W.threads || !W.deques)
+    error (1, errno, "walker: malloc() failed");
+  for (uint i = 0; i < jobs; i++)
+    pthread_mutex_init (&W.deques[i].lock, NULL);
+  /* Set before, as the threads read it. Deques whose thread couldn't be
+   * started are emptied by the others. */
+  W.jobs = jobs;
+  for (W.threadc = 0; W.threadc < jobs; W.threadc++)
+    {
+      int err = pthread_create (&W.threads[W.threadc], NULL, work,
+                                (void *) (uintptr_t) W.threadc);
+      if (err)
+        {
+          errno = err;
+          break;
+        }
+    }
+  if (!W.threadc)
+    {
+      W.jobs = 0;
+      free (W.threads);
+      free (W.deques);
+      return -1;
+    }
+  return 0;
+}
+
+void
+walker_stop (void)
+{
+  if (!W.jobs)
+    return;
+  pthread_mutex_lock (&W.lock);
+  W.stop = true;
+  pthread_mutex_unlock (&W.lock);
+  wake (&W.work, true);
+  for (uint i = 0; i < W.threadc; i++)
+    pthread_join (W.threads[i], NULL);
+  for (uint i = 0; i < W.jobs; i++)
+    {
+      pthread_mutex_destroy (&W.deques[i].lock);
+      free (W.deques[i].items);
+    }
+  free (W.threads);
+  free (W.deques);
+  W.jobs = 0;
+}
+
+uint
+walker_window (void)
+{
+  return W.jobs * WINDOW_PER_JOB;
+}
+
+uint
+walker_ahead (void)
+{
+  return W.jobs * (1 + WINDOW_PER_JOB);
+}
+
+/*  Queue the slots of w up to end (excluded) in the deque given, or
+ * spreading them over the deques if it is -1.
+ */
+static void
+queue_until (struct walk *w, uint end, int deque)
+{
+  if (end > w->count)
+    end = w->count;
+  uint first = w->queued;
+  if (first >= end)
+    return;
+  for (; w->queued < end; w->queued++)
+    {
+      /* Counted first, so that no thread waits while it is queued */
+      __atomic_add_fetch (&W.waiting, 1, __ATOMIC_SEQ_CST);
+      __atomic_add_fetch (&w->pending, 1, __ATOMIC_SEQ_CST);
+      push_back (&W.deques[-1 == deque ? W.next++ % W.jobs : (uint) deque],
+                 &w->slots[w->queued]);
+    }
+  if (__atomic_load_n (&W.sleepers, __ATOMIC_SEQ_CST))
+    wake (&W.work, end - first > 1);
+}
+
+/*  Returns a walk of flist, nothing queued yet
+ */
+static struct walk *
+new_walk (char *restrict * flist, int dirfd, const char *dir, uint levels)
+{
+  struct walk *w;
+  uint count = 0;
+  while (flist[count])
+    count++;
+  w = malloc (sizeof (*w));
+  if (w)
+    w->slots = malloc (count * sizeof (*w->slots) + 1);
+  if (!w || !w->slots)
+    error (1, errno, "walker: malloc() failed");
+  w->dirfd = dirfd;
+  w->dir = dir;
+  w->count = count;
+  w->queued = 0;
+  w->pending = 0;
+  w->cancelled = false;
+  w->ahead = false;
+  w->levels = levels;
+  for (uint i = 0; i < count; i++)
+    {
+      w->slots[i].w = w;
+      w->slots[i].leaf = flist[i];
+      w->slots[i].state = QUEUED;
+      w->slots[i].a = NULL;
+    }
+  return w;
+}
+
+struct walk *
+walk_list (char *restrict * flist, int dirfd, const char *dir,
+           uint levels)
+{
+  assert (flist);
+  struct walk *w;
+  if (!W.jobs)
+    return NULL;
+  w = new_walk (flist, dirfd, dir, levels);
+  queue_until (w, walker_window (), -1);
+  return w;
+}
+
+void
+walk_adopt (struct walk *w)
+{
+  assert (w);
+  if (w->ahead)
+    __atomic_sub_fetch (&W.ahead, 1, __ATOMIC_SEQ_CST);
+  w->ahead = false;
+}
+
+struct accused *
+walk_result (struct walk *w, uint n)
+{
+  assert (w && n < w->count);
+  struct slot *s = &w->slots[n];
+  struct accused *a;
+  queue_until (w, n + 1 + walker_window (), -1);
+  /* No thread took it yet, so don't wait for one */
+  if (!run (s, -1))
+    {
+      pthread_mutex_lock (&W.lock);
+      __atomic_store_n (&W.watching, true, __ATOMIC_SEQ_CST);
+      while (DONE != __atomic_load_n (&s->state, __ATOMIC_SEQ_CST))
+        pthread_cond_wait (&W.done, &W.lock);
+      __atomic_store_n (&W.watching, false, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock (&W.lock);
+    }
+  a = s->a;
+  s->a = NULL;
+  return a;
+}
+
+void
+walk_close (struct walk *w, struct law *l)
+{
+  assert (w && l);
+  walk_adopt (w);
+  __atomic_store_n (&w->cancelled, true, __ATOMIC_RELEASE);
+  /* The threads skip the slots left, wait for them to be dropped */
+  pthread_mutex_lock (&W.lock);
+  __atomic_store_n (&W.watching, true, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n (&w->pending, __ATOMIC_SEQ_CST))
+    pthread_cond_wait (&W.done, &W.lock);
+  __atomic_store_n (&W.watching, false, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock (&W.lock);
+  for (uint i = 0; i < w->queued; i++)
+    close_case (w->slots[i].a, l);
+  free (w->slots);
+  free (w);
+}
@@ -0,0 +1,88 @@
+/***************************************************************************/
+/*  Copyright (C) 2026 Brice Arnould.                                      */
+/*                                                                         */
+/*  This file is part of ShaKe.                                            */
+/*                                                                         */
+/*  ShaKe is free software; you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by   */
+/*  the Free Software Foundation; either version 3 of the License, or      */
+/*  (at your option) any later version.                                    */
+/*                                                                         */
+/*  This program is distributed in the hope that it will be useful,        */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of         */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          */
+/*  GNU General Public License for more details.                           */
+/*                                                                         */
+/*  You should have received a copy of the GNU General Public License      */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+/***************************************************************************/
+
+#ifndef WALKER_H
+# define WALKER_H
+# include "judge.h"
+
+/*  The walker runs investigate() in helper threads, ahead of
+ * window_feed(), so that the stat(), open() and FIEMAP of the next
+ * files overlap with the judgement of the current one.
+ *  Each thread has a deque of files to investigate : it takes from the
+ * front of its own and, when it is empty, steals from the back of the
+ * others. Only a few files past the one being judged are queued, so
+ * that the threads don't keep a whole directory open.
+ *  A thread which finds a directory also opens and lists it, and
+ * queues its first files in its own deque, where the others steal
+ * them : judge_dir() then takes them over (see accused.walk). At most
+ * one directory per thread is listed so, and none past the depth where
+ * judge_dir() stops keeping fds open.
+ *  judge() and shake_reg() still run in the main thread, and see the
+ * files in the order of the list.
+ */
+
+/*  Start jobs threads that will investigate() files with the law l.
+ *  Returns -1 and sets errno if no thread could be started.
+ */
+int walker_start (uint jobs, struct law *l);
+
+/*  Wait for the threads to finish and stop them.
+ */
+void walker_stop (void);
+
+/*  How many files can be investigated in advance, for each list
+ * (0 if the walker is not started)
+ */
+uint walker_window (void);
+
+/*  How many fds the threads may keep open for the directories they list
+ * in advance, and for the files of them (0 if the walker is not
+ * started)
+ */
+uint walker_ahead (void);
+
+/* A list of files being investigated, opaque
+ */
+struct walk;
+
+/*  Start to investigate the names of flist, relative to dirfd (see
+ * investigate()). flist and dir must stay valid until walk_close().
+ *  levels is how many levels of directories below flist judge_dir()
+ * reads relative to their fd, and so can be listed in advance.
+ *  Returns NULL if the walker is not started.
+ */
+struct walk *walk_list (char *restrict * flist, int dirfd,
+                        const char *dir, uint levels);
+
+/*  Returns what investigate() returned for flist[n], waiting for it if
+ * needed. It then belongs to the caller.
+ *  n must be greater than in the previous call.
+ */
+struct accused *walk_result (struct walk *w, uint n);
+
+/*  Takes over a walk the walker started in advance for a directory, see
+ * accused.walk. It then no longer counts as listed in advance.
+ */
+void walk_adopt (struct walk *w);
+
+/*  Free w and close the cases that weren't returned by walk_result()
+ */
+void walk_close (struct walk *w, struct law *l);
+
+#endif /* WALKER_H */
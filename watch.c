@@ -0,0 +1,351 @@
+/***************************************************************************/
+/*  Copyright (C) 2026 Brice Arnould.                                      */
+/*                                                                         */
+/*  This file is part of ShaKe.                                            */
+/*                                                                         */
+/*  ShaKe is free software; you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by   */
+/*  the Free Software Foundation; either version 3 of the License, or      */
+/*  (at your option) any later version.                                    */
+/*                                                                         */
+/*  This program is distributed in the hope that it will be useful,        */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of         */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          */
+/*  GNU General Public License for more details.                           */
+/*                                                                         */
+/*  You should have received a copy of the GNU General Public License      */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+/***************************************************************************/
+#define _GNU_SOURCE
+#include "config.h"
+#include "watch.h"
+#include <assert.h>
+#include <errno.h>
+
+#ifdef HAVE_SYS_FANOTIFY_H
+#include "throttle.h"           // throttle_pause()
+#include "visited.h"            // forget_visits()
+#include <stdlib.h>
+#include <stdint.h>             // uint64_t
+#include <stdio.h>              // snprintf()
+#include <error.h>              // error()
+#include <fcntl.h>              // open_by_handle_at()
+#include <limits.h>             // PATH_MAX
+#include <poll.h>               // poll()
+#include <time.h>               // time()
+#include <unistd.h>             // readlink(), getpid()
+#include <sys/stat.h>           // fstat()
+#include <sys/fanotify.h>
+
+/* A file written, waiting to be judged */
+struct written
+{
+  dev_t dev;
+  ino_t ino;
+  time_t last;                  // when it was last written
+  struct file_handle *handle;
+  struct written *prev;         // in the queue, by last write
+  struct written *next;
+  struct written *chain;        // in its bucket of the hash table
+};
+
+/* The queue of the written files, and a hash table on their inodes */
+static struct
+{
+  struct written *head;         // written first, judged first
+  struct written *tail;
+  struct written **buckets;
+  uint bits;                    // there are 1 << bits buckets
+  size_t count;
+} Q;
+
+/* The watched paths, to find the files from their handles */
+static int *MOUNTS;
+static int MOUNTC;
+
+/* Returns the bucket of an inode */
+static size_t
+bucket (dev_t dev, ino_t ino)
+{
+  uint64_t h = (uint64_t) ino ^ ((uint64_t) dev << 32);
+  return (size_t) ((h * 0x9e3779b97f4a7c15ULL) >> (64 - Q.bits));
+}
+
+/*  Returns the link to the file of this inode in the hash table, or
+ * the NULL link where it would go
+ */
+static struct written **
+find (dev_t dev, ino_t ino)
+{
+  struct written **w = Q.buckets + bucket (dev, ino);
+  while (*w && ((*w)->dev != dev || (*w)->ino != ino))
+    w = &(*w)->chain;
+  return w;
+}
+
+/*  Doubles the hash table, returns -1 if it can't
+ */
+static int
+grow (void)
+{
+  struct written **old = Q.buckets;
+  size_t oldsize = old ? (size_t) 1 << Q.bits : 0;
+  uint bits = old ? Q.bits + 1 : 10;
+  struct written **buckets = calloc ((size_t) 1 << bits, sizeof (*buckets));
+  if (!buckets)
+    return -1;
+  Q.buckets = buckets;
+  Q.bits = bits;
+  for (size_t i = 0; i < oldsize; i++)
+    while (old[i])
+      {
+        struct written *w = old[i];
+        struct written **s = Q.buckets + bucket (w->dev, w->ino);
+        old[i] = w->chain;
+        w->chain = *s;
+        *s = w;
+      }
+  free (old);
+  return 0;
+}
+
+/* Takes w out of the queue, it stays in the hash table */
+static void
+unqueue (struct written *w)
+{
+  *(w->prev ? &w->prev->next : &Q.head) = w->next;
+  *(w->next ? &w->next->prev : &Q.tail) = w->prev;
+}
+
+/* Puts w at the end of the queue */
+static void
+enqueue (struct written *w)
+{
+  w->next = NULL;
+  w->prev = Q.tail;
+  *(Q.tail ? &Q.tail->next : &Q.head) = w;
+  Q.tail = w;
+}
+
+/*  Returns a new struct written for the file fd refers to, whose stat
+ * is st, or NULL if it can't
+ */
+static struct written *
+new_written (int fd, struct stat *st)
+{
+  int mount_id;
+  struct written *w = malloc (sizeof (*w));
+  struct file_handle *fh = malloc (sizeof (*fh) + MAX_HANDLE_SZ);
+  struct file_handle *shrunk;
+  if (!w || !fh)
+    {
+      error (0, errno, "malloc() failed");
+      goto freeall;
+    }
+  fh->handle_bytes = MAX_HANDLE_SZ;
+  if (-1 == name_to_handle_at (fd, "", fh, &mount_id, AT_EMPTY_PATH))
+    {
+      error (0, errno, "failed to get a file handle");
+      goto freeall;
+    }
+  /* Keep the large buffer if it can't be shrunk */
+  shrunk = realloc (fh, sizeof (*fh) + fh->handle_bytes);
+  w->handle = shrunk ? shrunk : fh;
+  w->dev = st->st_dev;
+  w->ino = st->st_ino;
+  w->chain = NULL;
+  return w;
+freeall:
+  free (fh);
+  free (w);
+  return NULL;
+}
+
+/*  Queues the file fd refers to, or sends it back at the end of the
+ * queue if it already is there
+ */
+static void
+record (int fd)
+{
+  static bool warned = false;
+  struct stat st;
+  struct written **s, *w;
+  if (-1 == fstat (fd, &st) || !S_ISREG (st.st_mode) || !st.st_nlink)
+    return;
+  if ((!Q.buckets || Q.count >= (size_t) 1 << Q.bits) && -1 == grow ())
+    {
+      error (0, errno, "malloc() failed");
+      return;
+    }
+  s = find (st.st_dev, st.st_ino);
+  if (*s)
+    unqueue (w = *s);
+  else if (Q.count >= WATCH_MAX)
+    {
+      if (!warned)
+        error (0, 0, "too many files written, ignoring the next ones");
+      warned = true;
+      return;
+    }
+  else if ((w = new_written (fd, &st)))
+    {
+      *s = w;
+      Q.count++;
+    }
+  else
+    return;
+  w->last = time (NULL);
+  enqueue (w);
+}
+
+/* Takes w, already out of the queue, out of the hash table and frees it */
+static void
+forget (struct written *w)
+{
+  *find (w->dev, w->ino) = w->chain;
+  Q.count--;
+  free (w->handle);
+  free (w);
+}
+
+/*  Judges w under its current name, if it still exists. Returns 1 if it
+ * is too recent to be judged yet, else 0.
+ */
+static int
+judge_written (struct written *w, struct law *l)
+{
+  char link[64], name[PATH_MAX];
+  ssize_t len = -1;
+  int res = 0;
+  struct accused *a;
+  /*  Any fd of the filesystem can decode the handle, the one of the
+   * right filesystem is found by checking the inode
+   */
+  for (int i = 0; i < MOUNTC && -1 == len; i++)
+    {
+      struct stat st;
+      int fd = open_by_handle_at (MOUNTS[i], w->handle, O_PATH);
+      if (-1 == fd)
+        continue;
+      if (0 == fstat (fd, &st) && st.st_dev == w->dev && st.st_ino == w->ino)
+        {
+          snprintf (link, sizeof (link), "/proc/self/fd/%i", fd);
+          len = readlink (link, name, sizeof (name) - 1);
+        }
+      close (fd);
+    }
+  if (len <= 0)
+    return 0;                   // deleted since
+  name[len] = '\0';
+  throttle_pause ();
+  a = investigate (AT_FDCWD, NULL, name, l);
+  if (!a)
+    return 0;                   // error have been displayed by investigate()
+  if (a->fs == w->dev && a->ino == w->ino)
+    {
+      res = too_new (a, l);
+      if (!res)
+        judge (a, l);
+    }
+  close_case (a, l);
+  /* Files with several links can be written and judged again */
+  forget_visits ();
+  return res;
+}
+
+/* Reads the events waiting on fan and queues the files they name */
+static void
+read_events (int fan)
+{
+  char buf[16 * 1024]
+    __attribute__ ((aligned (__alignof__ (struct fanotify_event_metadata))));
+  struct fanotify_event_metadata *m = (void *) buf;
+  ssize_t len = read (fan, buf, sizeof (buf));
+  if (-1 == len)
+    {
+      if (EAGAIN != errno && EINTR != errno)
+        error (1, errno, "failed to read fanotify events");
+      return;
+    }
+  for (; FAN_EVENT_OK (m, len); m = FAN_EVENT_NEXT (m, len))
+    {
+      if (FANOTIFY_METADATA_VERSION != m->vers)
+        error (1, 0, "unsupported fanotify version");
+      if (m->mask & FAN_Q_OVERFLOW)
+        error (0, 0, "too many writes at once, some files were missed");
+      if (m->fd < 0)
+        continue;
+      /* Our own rewrites close files after writing them too */
+      if (m->pid != getpid ())
+        record (m->fd);
+      close (m->fd);
+    }
+}
+
+int
+watch (char **paths, int count, struct law *l)
+{
+  const time_t delay = l->new > WATCH_DELAY ? l->new : WATCH_DELAY;
+  int fan;
+  assert (paths && count > 0 && l);
+  fan = fanotify_init (FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK,
+                       O_RDONLY | O_LARGEFILE | O_NOATIME | O_CLOEXEC);
+  if (-1 == fan)
+    return -1;
+  MOUNTS = malloc ((size_t) count * sizeof (*MOUNTS));
+  if (!MOUNTS)
+    error (1, errno, "malloc() failed");
+  for (int i = 0; i < count; i++)
+    {
+      MOUNTS[i] = open (paths[i], O_RDONLY | O_CLOEXEC);
+      if (-1 == MOUNTS[i]
+          || -1 == fanotify_mark (fan, FAN_MARK_ADD | FAN_MARK_MOUNT,
+                                  FAN_CLOSE_WRITE, AT_FDCWD, paths[i]))
+        error (1, errno, "%s: failed to watch", paths[i]);
+    }
+  MOUNTC = count;
+  while (1)
+    {
+      struct pollfd pfd = {.fd = fan,.events = POLLIN };
+      time_t now = time (NULL);
+      int timeout = -1;         // until an event comes
+      if (Q.head)
+        {
+          time_t wait = Q.head->last + delay - now;
+          /* Wake up now and then, the clock may change */
+          timeout = wait <= 0 ? 0 : 1000 * (int) (wait > 3600 ? 3600 : wait);
+        }
+      if (-1 == poll (&pfd, 1, timeout) && EINTR != errno)
+        error (1, errno, "poll() failed");
+      if (pfd.revents & POLLIN)
+        read_events (fan);
+      /*  One file at a time, so that the events are read meanwhile. A
+       * file that the tolerance of its size keeps new longer than delay
+       * is tried again after another delay, to keep the queue in order.
+       */
+      if (Q.head && Q.head->last + delay <= time (NULL))
+        {
+          struct written *w = Q.head;
+          unqueue (w);
+          if (1 == judge_written (w, l))
+            {
+              w->last = time (NULL);
+              enqueue (w);
+            }
+          else
+            forget (w);
+        }
+    }
+}
+
+#else /* HAVE_SYS_FANOTIFY_H */
+
+int
+watch (char **paths, int count, struct law *l)
+{
+  assert (paths && count > 0 && l);
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif /* HAVE_SYS_FANOTIFY_H */
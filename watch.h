@@ -0,0 +1,47 @@
+/***************************************************************************/
+/*  Copyright (C) 2026 Brice Arnould.                                      */
+/*                                                                         */
+/*  This file is part of ShaKe.                                            */
+/*                                                                         */
+/*  ShaKe is free software; you can redistribute it and/or modify          */
+/*  it under the terms of the GNU General Public License as published by   */
+/*  the Free Software Foundation; either version 3 of the License, or      */
+/*  (at your option) any later version.                                    */
+/*                                                                         */
+/*  This program is distributed in the hope that it will be useful,        */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of         */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          */
+/*  GNU General Public License for more details.                           */
+/*                                                                         */
+/*  You should have received a copy of the GNU General Public License      */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+/***************************************************************************/
+#ifndef WATCH_H
+# define WATCH_H
+# include "judge.h"
+
+/*  In watch mode, shake scans nothing: fanotify tells it which files
+ * are closed after a write on the watched mounts, and each one is
+ * judged once it has been left alone long enough. Files that nobody
+ * writes are never looked at again.
+ *  Events are merged per inode, a file written again goes back at the
+ * end of the queue. It is judged WATCH_DELAY seconds after its last
+ * write, or once it is no longer new (see --new) if that is later; as
+ * the tolerances can keep the small and big files new longer, they are
+ * then queued again until they are not.
+ *  Files are found again through their file handle, so that those
+ * renamed since are judged under their new name, and those deleted are
+ * forgotten.
+ */
+# define WATCH_DELAY 60
+
+/* Files queued at most, the writes to other files are then ignored */
+# define WATCH_MAX (1 << 20)
+
+/*  Watches the mounts of the count paths and judges the files written
+ * there, until a signal comes. Needs CAP_SYS_ADMIN.
+ *  Returns -1 and sets errno if fanotify isn't available.
+ */
+int watch (char **paths, int count, struct law *l);
+
+#endif /* WATCH_H */